@@ -0,0 +1,139 @@
+#pragma once
+
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <queue>
+#include <string>
+#include <utility>
+
+#include "absl/status/status.h"
+#include "absl/synchronization/mutex.h"
+
+// Runs each task on its own thread, but keeps up to `max_idle` finished
+// threads parked for reuse instead of paying for thread creation and teardown
+// on every task. At most `max_threads` exist at once; Run blocks beyond that.
+// Destruction waits for running tasks and for every thread to exit.
+class ThreadCache {
+ public:
+  ThreadCache(size_t max_threads, size_t max_idle, size_t stack_size,
+              std::function<void(int)> on_start = nullptr)
+      : _max_threads(std::max<size_t>(max_threads, 1)),
+        _max_idle(max_idle),
+        _stack_size(std::max<size_t>(stack_size, PTHREAD_STACK_MIN)),
+        _on_start(std::move(on_start)) {}
+  ThreadCache(const ThreadCache&) = delete;
+  ThreadCache& operator=(const ThreadCache&) = delete;
+  ~ThreadCache() {
+    absl::MutexLock lck(&_m);
+    _m.Await(absl::Condition(this, &ThreadCache::AllIdle));
+    // a null task tells a parked thread to exit
+    for (size_t i = 0; i < _idle; ++i) {
+      _tasks.emplace(nullptr);
+    }
+    _m.Await(absl::Condition(this, &ThreadCache::NoThreads));
+  }
+
+  absl::Status Run(std::function<void()> f) {
+    absl::MutexLock lck(&_m);
+    _m.Await(absl::Condition(this, &ThreadCache::CanRun));
+    if (_idle > _tasks.size()) {  // a parked thread will pick it up
+      _tasks.emplace(std::move(f));
+      return absl::OkStatus();
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    int rc = pthread_attr_setstacksize(&attr, _stack_size);
+    if (rc != 0) {
+      pthread_attr_destroy(&attr);
+      return absl::InvalidArgumentError(
+          std::string("pthread_attr_setstacksize: ") + strerror(rc));
+    }
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    auto start = new Start{this, _created, std::move(f)};
+    pthread_t tid;
+    rc = pthread_create(&tid, &attr, &ThreadCache::ThreadMain, start);
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+      delete start;
+      return absl::ResourceExhaustedError(
+          std::string("pthread_create: ") + strerror(rc));
+    }
+    ++_threads;
+    ++_created;
+    return absl::OkStatus();
+  }
+
+  // Waits until every running task has finished.
+  void Drain() {
+    absl::MutexLock lck(&_m);
+    _m.Await(absl::Condition(this, &ThreadCache::AllIdle));
+  }
+
+ private:
+  struct Start {
+    ThreadCache* cache;
+    int index;
+    std::function<void()> f;
+  };
+
+  static void* ThreadMain(void* arg) {
+    auto start = static_cast<Start*>(arg);
+    auto cache = start->cache;
+    int index = start->index;
+    auto f = std::move(start->f);
+    delete start;
+    cache->WorkerLoop(index, std::move(f));
+    return nullptr;
+  }
+
+  void WorkerLoop(int index, std::function<void()> f) {
+    if (_on_start) {
+      _on_start(index);
+    }
+    while (1) {
+      f();
+      f = nullptr;
+      absl::MutexLock l(&_m);
+      if (_idle >= _max_idle) {
+        --_threads;
+        break;
+      }
+      ++_idle;
+      _m.Await(absl::Condition(this, &ThreadCache::HasTask));
+      --_idle;
+      f = std::move(_tasks.front());
+      _tasks.pop();
+      if (f == nullptr) {  // shutting down
+        --_threads;
+        break;
+      }
+    }
+  }
+  bool CanRun() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(_m) {
+    return _idle > _tasks.size() || _threads < _max_threads;
+  }
+  bool AllIdle() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(_m) {
+    return _idle == _threads && _tasks.empty();
+  }
+  bool HasTask() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(_m) {
+    return !_tasks.empty();
+  }
+  bool NoThreads() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(_m) {
+    return _threads == 0;
+  }
+  const size_t _max_threads;
+  const size_t _max_idle;
+  const size_t _stack_size;
+  std::function<void(int)> _on_start;
+  absl::Mutex _m;
+  std::queue<std::function<void()>> _tasks GUARDED_BY(_m);
+  size_t _threads GUARDED_BY(_m) = 0;
+  size_t _idle GUARDED_BY(_m) = 0;
+  int _created GUARDED_BY(_m) = 0;
+};
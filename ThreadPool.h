@@ -12,12 +12,16 @@
 
 class ThreadPool {
  public:
-  explicit ThreadPool(size_t num) {
+  // `on_start` runs first thing on each worker with the worker's index, e.g.
+  // to pin it before it touches any memory
+  explicit ThreadPool(size_t num, std::function<void(int)> on_start = nullptr)
+      : _on_start(std::move(on_start)) {
     if (num > 32) {
       num = 4;
     }
     for (size_t i = 0; i < num; ++i) {
-      _workers.emplace_back(std::thread(&ThreadPool::WorkerLoop, this));
+      _workers.emplace_back(
+          std::thread(&ThreadPool::WorkerLoop, this, static_cast<int>(i)));
     }
   }
   ThreadPool(const ThreadPool&) = delete;
@@ -51,7 +55,10 @@ class ThreadPool {
   }
 
  private:
-  void WorkerLoop() {
+  void WorkerLoop(int index) {
+    if (_on_start) {
+      _on_start(index);
+    }
     while (1) {
       std::function<void()> f;
       {
@@ -69,6 +76,7 @@ class ThreadPool {
   bool Avaliavle() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(_m) {
     return !_tasks.empty();
   }
+  std::function<void(int)> _on_start;
   absl::Mutex _m;
   std::vector<std::thread> _workers;
   std::queue<std::function<void()>> _tasks GUARDED_BY(_m);
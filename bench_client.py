@@ -0,0 +1,189 @@
+import socket
+import argparse
+import selectors
+import time
+import threading
+
+
+def percentile(sorted_samples, p):
+    if not sorted_samples:
+        return 0
+    idx = min(len(sorted_samples) - 1, int(len(sorted_samples) * p / 100))
+    return sorted_samples[idx]
+
+
+def connect(target, port):
+    # target is an ip, or unix:<path> / unix:@<name> for a unix socket
+    if target.startswith('unix:'):
+        path = target[len('unix:'):]
+        if path.startswith('@'):
+            path = '\0' + path[1:]
+        sock_fd = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        sock_fd.connect(path)
+        return sock_fd
+    sock_fd = socket.create_connection((target, port))
+    sock_fd.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    return sock_fd
+
+
+def ping_pong(ip, port, num_messages, samples, lock):
+    try:
+        sock_fd = connect(ip, port)
+    except OSError as e:
+        print(f'socket error: {e}')
+        return
+    if sock_fd.recv(1) != b'*':
+        print('cannot receive * from remote')
+        return
+
+    # every '^a$' is answered with a single 'b'
+    local = []
+    for _ in range(num_messages):
+        start = time.perf_counter_ns()
+        sock_fd.send(b'^a$')
+        if sock_fd.recv(1) != b'b':
+            print('unexpected reply from remote')
+            break
+        local.append(time.perf_counter_ns() - start)
+    sock_fd.close()
+
+    with lock:
+        samples.extend(local)
+
+
+def fanout(ip, port, num_subscribers, num_messages):
+    # run the server with CONCURRENT_PUBSUB=1; every '^a$' the publisher
+    # sends reaches all subscribers, the publisher included, as one 'b'
+    subscribers = []
+    for _ in range(num_subscribers):
+        sock_fd = connect(ip, port)
+        if sock_fd.recv(1) != b'*':
+            print('cannot receive * from remote')
+            return [], 0, 0
+        sock_fd.setblocking(False)
+        subscribers.append(sock_fd)
+    print(f'{num_subscribers} subscribers connected')
+
+    sel = selectors.DefaultSelector()
+    for sock_fd in subscribers:
+        sel.register(sock_fd, selectors.EVENT_READ)
+    publisher = subscribers[0]
+
+    # latency is until the last live subscriber has the message
+    samples = []
+    live = set(subscribers)
+    deliveries = 0
+    dropped = 0
+    for _ in range(num_messages):
+        if publisher not in live:
+            print('publisher dropped by remote')
+            break
+        start = time.perf_counter_ns()
+        publisher.send(b'^a$')
+        waiting = {sock_fd: 1 for sock_fd in live}
+        deliveries += len(waiting)
+        while waiting:
+            for key, _ in sel.select():
+                sock_fd = key.fileobj
+                buf = sock_fd.recv(4096)
+                if not buf:
+                    sel.unregister(sock_fd)
+                    live.discard(sock_fd)
+                    waiting.pop(sock_fd, None)
+                    dropped += 1
+                    continue
+                if sock_fd in waiting:
+                    waiting[sock_fd] -= len(buf)
+                    if waiting[sock_fd] <= 0:
+                        del waiting[sock_fd]
+        samples.append(time.perf_counter_ns() - start)
+
+    for sock_fd in subscribers:
+        sock_fd.close()
+    return samples, deliveries, dropped
+
+
+def histogram(sorted_samples):
+    # power-of-two buckets in microseconds
+    buckets = {}
+    for ns in sorted_samples:
+        us = max(1, ns // 1000)
+        upper = 1 << (us - 1).bit_length()
+        buckets[upper] = buckets.get(upper, 0) + 1
+    widest = max(buckets.values())
+    for upper in sorted(buckets):
+        count = buckets[upper]
+        bar = '#' * max(1, count * 50 // widest)
+        print(f'<= {upper:>7} us {count:>8} {bar}')
+
+
+def report(samples, elapsed, show_histogram):
+    samples.sort()
+    print(f'messages: {len(samples)}  '
+          f'throughput: {len(samples) / elapsed:.0f} msg/s')
+    for p in (50, 90, 99, 99.9):
+        print(f'p{p:<5} {percentile(samples, p) / 1000:10.1f} us')
+    if samples:
+        print(f'max    {samples[-1] / 1000:10.1f} us')
+    if show_histogram and samples:
+        histogram(samples)
+
+
+def main():
+    argparser = argparse.ArgumentParser('round-trip latency benchmark')
+    argparser.add_argument('ip', help='remote ip, or unix:<path> / unix:@<name>')
+    argparser.add_argument('port', type=int, nargs='?', default=9990,
+                           help='remote port')
+    argparser.add_argument('-n', type=int, default=1,
+                           help='num of concurrent connection', dest='num_concurrent')
+    argparser.add_argument('-m', type=int, default=10000,
+                           help='messages per connection', dest='num_messages')
+    argparser.add_argument('--histogram', action='store_true',
+                           help='print a latency histogram')
+    argparser.add_argument('--fanout', type=int, default=0, metavar='N',
+                           help='publish -m messages to N pub/sub subscribers')
+    argparser.add_argument('--compare', metavar='TARGET',
+                           help='run again against TARGET, e.g. a unix: '
+                                'listener of the same server')
+
+    args = argparser.parse_args()
+
+    targets = [args.ip] if args.compare is None else [args.ip, args.compare]
+    for target in targets:
+        if args.compare is not None:
+            print(f'== {target}')
+        run(args, target)
+
+
+def run(args, target):
+    if args.fanout > 0:
+        samples, deliveries, dropped = fanout(target, args.port, args.fanout,
+                                              args.num_messages)
+        if dropped:
+            print(f'subscribers dropped by remote: {dropped}')
+        if not samples:
+            print('no messages delivered')
+            return
+        elapsed = sum(samples) / 1e9
+        print(f'deliveries: {deliveries / elapsed:.0f}/s')
+        report(samples, elapsed, args.histogram)
+        return
+
+    samples = []
+    lock = threading.Lock()
+    start = time.time()
+    workers = []
+    for _ in range(args.num_concurrent):
+        t = threading.Thread(target=ping_pong,
+                             args=(target, args.port, args.num_messages, samples, lock))
+        t.start()
+        workers.append(t)
+
+    for w in workers:
+        w.join()
+
+    report(samples, time.time() - start, args.histogram)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,125 @@
+#include "capture.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fmt/printf.h"
+#include "helpers.h"
+
+namespace {
+
+struct Capture {
+  char *base;
+  CaptureHeader *header;
+  uint32_t generation;
+};
+
+}  // namespace
+
+// maps the file named by CONCURRENT_CAPTURE; nullptr when capture is off
+static Capture *open_capture() {
+  const char *path = getenv("CONCURRENT_CAPTURE");
+  if (path == nullptr || *path == '\0') {
+    return nullptr;
+  }
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fmt::printf("capture %s: %s\n", path, strerror(errno));
+    exit(-1);
+  }
+  // an existing capture, e.g. the previous generation's, is appended to
+  bool existing = static_cast<size_t>(st.st_size) >= sizeof(CaptureHeader);
+  uint64_t capacity = static_cast<uint64_t>(st.st_size);
+  if (!existing) {
+    capacity = static_cast<uint64_t>(env_int("CONCURRENT_CAPTURE_MB", 1024))
+               << 20;
+    if (capacity < sizeof(CaptureHeader) || ftruncate(fd, capacity) != 0) {
+      fmt::printf("capture %s: cannot size to %lu bytes\n", path, capacity);
+      exit(-1);
+    }
+  }
+  void *base =
+      mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    fmt::printf("capture mmap: %s\n", strerror(errno));
+    exit(-1);
+  }
+
+  auto header = static_cast<CaptureHeader *>(base);
+  if (!existing) {
+    memcpy(header->magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+    header->version = CAPTURE_VERSION;
+    header->used = sizeof(CaptureHeader);
+    header->capacity = capacity;
+    header->generations = 0;
+  } else if (memcmp(header->magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) !=
+                 0 ||
+             header->version != CAPTURE_VERSION ||
+             header->capacity != capacity) {
+    fmt::printf("capture %s: not a capture file, refusing to overwrite\n",
+                path);
+    exit(-1);
+  }
+  // the generation is the top byte of a conn_id, so a 257th would reuse
+  // generation 0's ids; the counter stops at CAPTURE_MAX_GENERATIONS
+  uint32_t generation = __atomic_load_n(&header->generations, __ATOMIC_RELAXED);
+  do {
+    if (generation >= CAPTURE_MAX_GENERATIONS) {
+      fmt::printf("capture %s: %u generations already, not capturing\n", path,
+                  generation);
+      munmap(base, capacity);
+      return nullptr;
+    }
+  } while (!__atomic_compare_exchange_n(&header->generations, &generation,
+                                        generation + 1, true, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED));
+  auto capture = new Capture{static_cast<char *>(base), header, generation};
+  fmt::printf("capturing to %s, generation %u\n", path, capture->generation);
+  return capture;
+}
+
+static void append(CaptureKind kind, int fd, const void *data, size_t len) {
+  static Capture *const capture = open_capture();
+  if (capture == nullptr) {
+    return;
+  }
+  auto header = capture->header;
+  uint64_t size = (sizeof(CaptureRecord) + len + 7) & ~uint64_t{7};
+  uint64_t pos = __atomic_load_n(&header->used, __ATOMIC_RELAXED);
+  do {
+    if (pos + size > header->capacity) {
+      static bool full = false;
+      if (!__atomic_exchange_n(&full, true, __ATOMIC_RELAXED)) {
+        fmt::printf("capture file full, no longer capturing\n");
+      }
+      return;
+    }
+  } while (!__atomic_compare_exchange_n(&header->used, &pos, pos + size, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  auto record = reinterpret_cast<CaptureRecord *>(capture->base + pos);
+  record->ts_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  record->conn_id = capture->generation << 24 | (fd & 0xffffff);
+  record->len = len;
+  memcpy(record + 1, data, len);
+  // readers take a record as complete once its kind is set
+  __atomic_store_n(&record->kind, kind, __ATOMIC_RELEASE);
+}
+
+void capture_connect(int fd) { append(CAPTURE_CONNECT, fd, nullptr, 0); }
+
+void capture_data(int fd, const void *data, size_t len) {
+  append(CAPTURE_DATA, fd, data, len);
+}
+
+void capture_close(int fd) { append(CAPTURE_CLOSE, fd, nullptr, 0); }
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Traffic capture for replay_client.py. With CONCURRENT_CAPTURE=<path> every
+// server appends the bytes it receives, with timestamps, to a memory-mapped
+// capture file of CONCURRENT_CAPTURE_MB (default 1024, allocated sparsely).
+// Without it each call is a no-op.
+//
+// The file is a CaptureHeader followed by 8-byte aligned records, each a
+// CaptureRecord and `len` bytes of data. Writers reserve space by bumping
+// `used` and publish a record by storing its kind last, so a reader stops at
+// the first record whose kind is still 0. A hot-restarted server keeps
+// appending to the same file; every process takes a new generation, which
+// becomes the top byte of its conn_ids, so fds reused across generations
+// stay distinct. Past CAPTURE_MAX_GENERATIONS a server does not capture;
+// start a new file instead.
+constexpr char CAPTURE_MAGIC[4] = {'C', 'C', 'A', 'P'};
+constexpr uint32_t CAPTURE_VERSION = 1;
+constexpr uint32_t CAPTURE_MAX_GENERATIONS = 256;
+
+struct CaptureHeader {
+  char magic[4];
+  uint32_t version;
+  uint64_t used;  // bytes in use, the header included
+  uint64_t capacity;
+  uint32_t generations;
+  uint32_t pad;
+};
+
+enum CaptureKind : uint8_t {
+  CAPTURE_CONNECT = 1,
+  CAPTURE_DATA = 2,
+  CAPTURE_CLOSE = 3,
+};
+
+struct CaptureRecord {
+  uint64_t ts_ns;  // CLOCK_MONOTONIC
+  uint32_t conn_id;
+  uint32_t len;
+  uint8_t kind;
+  uint8_t pad[7];
+};
+
+// Connections are named by fd, as in the probes. The close record must be
+// written before the fd is closed, or a new connection could reuse it first.
+void capture_connect(int fd);
+void capture_data(int fd, const void *data, size_t len);
+void capture_close(int fd);
@@ -1,23 +1,54 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <netinet/in.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
 #include "absl/strings/string_view.h"
+#include "capture.h"
 #include "fmt/ostream.h"
 #include "fmt/printf.h"
 #include "helpers.h"
+#include "probes.h"
 
 constexpr int MAX_BUF = 1024;
 constexpr int EPOLL_SIZE = 2048;
+// chunks of the output chain written per sendmsg
+constexpr int IOV_BATCH = 64;
+// empty polls spent spinning flat out, then pausing, before yielding the cpu
+constexpr int SPIN_POLLS = 64;
+constexpr int PAUSE_POLLS = 1024;
+// connections shed per overloaded window
+constexpr int SHED_PER_WINDOW = 1;
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+// BLOCK sleeps in epoll_wait, SPIN never does, HYBRID spins until it has been
+// idle for CONCURRENT_POLL_IDLE_US and then blocks until the next event
+enum class PollMode {
+  BLOCK,
+  SPIN,
+  HYBRID,
+};
 
 enum class State {
   INIT_CONN,
@@ -25,33 +56,137 @@ enum class State {
   IN_MESSAGE,
 };
 
+// transformed output is immutable once built, so in pub/sub mode one buffer
+// is queued by reference on every subscriber instead of being copied
+using Payload = std::shared_ptr<const std::string>;
+
+struct Chunk {
+  Payload data;
+  size_t pos;
+};
+
+// refilled lazily at `rate` tokens per second up to `burst`; a rate of 0
+// means unlimited. Messages are charged after they are read, so the message
+// bucket can go into debt and hold the connection back until it is repaid.
+struct TokenBucket {
+  double rate;
+  double burst;
+  double tokens;
+  int64_t last_us;
+};
+
 struct Connection {
   State state;
-  char send_buf[MAX_BUF];
-  int send_end;
-  int send_pos;
+  std::deque<Chunk> out;  // output chain
+  size_t queued;          // bytes left on the output chain
+  uint32_t events;        // what epoll is watching for
+  bool dropped;
+  bool taken_over;  // passed on hot restart, so its first bytes came earlier
   int fd;
+  int64_t bytes_in;
+  int64_t bytes_out;
+  int64_t msg_bytes;
+  int64_t unsent;  // queued since the output chain was last empty
+  TokenBucket bytes_limit;
+  TokenBucket msgs_limit;
+  int64_t resume_at;   // when a throttled connection may read again, else 0
+  int64_t cost;        // bytes handled on its behalf during `cost_window`
+  int64_t cost_window;
 };
 
+// every live connection: subscribers in pub/sub mode, and the candidates a
+// hot restart can pass on
+std::unordered_set<Connection *> connections;
+// connections to close once the current batch of events is handled
+std::vector<Connection *> dropped;
+// CONCURRENT_PUBSUB: messages go to every connection instead of the sender
+bool pubsub = false;
+// connections with more output queued than this are too slow and dropped
+size_t max_queued = 0;
+// connections not reading until their token buckets refill
+std::unordered_set<Connection *> throttled;
+
+// CONCURRENT_RATE_BYTES and CONCURRENT_RATE_MSGS: per connection limits per
+// second, with buckets CONCURRENT_BURST_MS deep
+double rate_bytes = 0;
+double rate_msgs = 0;
+int64_t burst_ms = 0;
+// CONCURRENT_READ_BUDGET: bytes read from one connection per loop iteration,
+// so a busy client cannot starve the others in the same batch
+size_t read_budget = 0;
+
+// CONCURRENT_LAG_US: the loop counts as overloaded when a batch of events
+// took longer than this to handle, judged once per CONCURRENT_SHED_MS window.
+// While overloaded it stops accepting and sheds the connections that cost
+// the most during the last window.
+int64_t lag_limit_us = 0;
+int64_t window_us = 0;
+int64_t window_end = 0;
+int64_t window_lag = 0;  // longest batch in the current window
+int64_t cost_window = 0;
+bool overloaded = false;
+
 absl::Status serve(int fd);
-void on_connect(int ep_fd, int sock_fd, const sockaddr_in &addr, socklen_t len);
+PollMode poll_mode();
+void backoff(int empty_polls);
+int64_t now_us();
+void on_connect(int ep_fd, int sock_fd, const sockaddr *addr, socklen_t len,
+                PollMode mode);
+void watch_listeners(int ep_fd, const std::vector<int> &sock_fds, bool accept);
+Connection *add_connection(int ep_fd, int fd, State state);
+void on_takeover(int ep_fd, const HandoffFd &passed);
+void on_handoff(int ep_fd, const std::vector<int> &sock_fds, int handoff_fd);
 void on_receive(int ep_fd, Connection *conn);
 void on_send(int ep_fd, Connection *conn);
+void watch(int ep_fd, Connection *conn, uint32_t events);
+void enqueue(int ep_fd, Connection *conn, const Payload &data);
+void drop_connection(Connection *conn);
+void close_connection(int ep_fd, Connection *conn);
+TokenBucket make_bucket(double rate, int64_t now);
+void refill(TokenBucket &bucket, int64_t now);
+int64_t refill_wait_us(const TokenBucket &bucket, double want);
+uint32_t read_events(const Connection *conn);
+int64_t resume_throttled(int ep_fd, int64_t now);
+void charge(Connection *conn, int64_t nbytes);
+void check_overload(int ep_fd, const std::vector<int> &sock_fds, int64_t lag,
+                    int64_t now);
+void shed_connections();
 
 int main() {
-  auto sock_fd = tcpServer("0.0.0.0", 9990);
-  set_nonblock(sock_fd);
+  std::vector<HandoffFd> inherited;
+  auto sock_fds = listenServers("0.0.0.0", 9990, &inherited);
+  for (int sock_fd : sock_fds) {
+    set_nonblock(sock_fd);
+  }
+  pin_thread(0);
+  pubsub = env_int("CONCURRENT_PUBSUB", 0) != 0;
+  max_queued = env_int("CONCURRENT_MAX_QUEUED_KB", 1024) * 1024;
+  rate_bytes = env_int("CONCURRENT_RATE_BYTES", 0);
+  rate_msgs = env_int("CONCURRENT_RATE_MSGS", 0);
+  burst_ms = std::max(env_int("CONCURRENT_BURST_MS", 1000), 1);
+  read_budget = std::max(env_int("CONCURRENT_READ_BUDGET", 16384), 1);
+  lag_limit_us = env_int("CONCURRENT_LAG_US", 0);
+  window_us = std::max(env_int("CONCURRENT_SHED_MS", 100), 1) * 1000;
 
   auto ep_fd = epoll_create(EPOLL_SIZE);
 
-  epoll_event accept_event;
-  memset(&accept_event, 0, sizeof(epoll_event));
-  accept_event.data.fd = sock_fd;
-  accept_event.events = EPOLLIN;
-  if (epoll_ctl(ep_fd, EPOLL_CTL_ADD, sock_fd, &accept_event) < 0) {
-    fmt::printf("epoll_ctl: %s\n", strerror(errno));
-    exit(-1);
+  watch_listeners(ep_fd, sock_fds, true);
+  for (auto &passed : inherited) {
+    on_takeover(ep_fd, passed);
+  }
+
+  auto handoff_fd = handoffServer();
+  if (handoff_fd >= 0) {
+    epoll_event handoff_event;
+    memset(&handoff_event, 0, sizeof(epoll_event));
+    handoff_event.data.fd = handoff_fd;
+    handoff_event.events = EPOLLIN;
+    if (epoll_ctl(ep_fd, EPOLL_CTL_ADD, handoff_fd, &handoff_event) < 0) {
+      fmt::printf("epoll_ctl: %s\n", strerror(errno));
+      exit(-1);
+    }
   }
+  bool handed_off = false;
 
   epoll_event *events =
       static_cast<epoll_event *>(calloc(EPOLL_SIZE, sizeof(epoll_event)));
@@ -60,165 +195,574 @@ int main() {
     exit(-1);
   }
 
-  while (1) {
-    int nready = epoll_wait(ep_fd, events, EPOLL_SIZE, -1);
+  auto mode = poll_mode();
+  int64_t idle_us = env_int("CONCURRENT_POLL_IDLE_US", 1000);
+  int64_t last_event = now_us();
+  int empty_polls = 0;
+
+  // after a handoff, serve the connections left here until they are gone
+  while (!handed_off || !connections.empty()) {
+    int64_t now = now_us();
+    int timeout = -1;
+    if (mode == PollMode::SPIN ||
+        (mode == PollMode::HYBRID && now - last_event < idle_us)) {
+      timeout = 0;
+    }
+    // wake up for the next throttled connection, and keep closing windows
+    // while overloaded so an idle loop gets to resume accepting
+    int64_t wait_us = resume_throttled(ep_fd, now);
+    if (overloaded && (wait_us < 0 || window_end - now < wait_us)) {
+      wait_us = std::max<int64_t>(window_end - now, 0);
+    }
+    if (timeout < 0 && wait_us >= 0) {
+      timeout = (wait_us + 999) / 1000;
+    }
+    int nready = epoll_wait(ep_fd, events, EPOLL_SIZE, timeout);
+    int64_t batch_start = now_us();
+    if (nready <= 0) {
+      if (timeout == 0) {
+        backoff(++empty_polls);
+      }
+      nready = 0;
+    } else {
+      empty_polls = 0;
+    }
+    if (nready > 0 && mode == PollMode::HYBRID) {
+      last_event = batch_start;
+    }
     for (int i = 0; i < nready; ++i) {
-      if (events[i].data.fd == sock_fd) {  // new connection
-        sockaddr_in peer_addr;
+      int fd = events[i].data.fd;
+      if (std::find(sock_fds.begin(), sock_fds.end(), fd) !=
+          sock_fds.end()) {  // new connection
+        sockaddr_storage peer_addr;
         socklen_t peer_addr_len = sizeof(peer_addr);
 
-        int client_fd = accept(
-            sock_fd, reinterpret_cast<sockaddr *>(&peer_addr), &peer_addr_len);
+        int client_fd = accept(fd, reinterpret_cast<sockaddr *>(&peer_addr),
+                               &peer_addr_len);
         if (client_fd < 0) {
           // if (errno == EAGAIN || errno == EWOULDBLOCK) {}
           fmt::printf("accept: %s\n", strerror(errno));
           exit(-1);
         } else {  // ready to connect
-          on_connect(ep_fd, client_fd, peer_addr, peer_addr_len);
+          on_connect(ep_fd, client_fd, reinterpret_cast<sockaddr *>(&peer_addr),
+                     peer_addr_len, mode);
         }
+      } else if (handoff_fd >= 0 && fd == handoff_fd) {
+        on_handoff(ep_fd, sock_fds, handoff_fd);
+        handed_off = true;
+        break;  // the rest of this batch may point at handed off connections
       } else {
-        if (events[i].events & EPOLLIN) {
-          on_receive(ep_fd, reinterpret_cast<Connection *>(events[i].data.ptr));
+        auto conn = reinterpret_cast<Connection *>(events[i].data.ptr);
+        if (conn->dropped) {
+          continue;
+        } else if (events[i].events & EPOLLIN) {
+          on_receive(ep_fd, conn);
         } else if (events[i].events & EPOLLOUT) {
-          on_send(ep_fd, reinterpret_cast<Connection *>(events[i].data.ptr));
+          on_send(ep_fd, conn);
+        } else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+          // reported even while a throttled connection watches for nothing
+          drop_connection(conn);
         }
       }
     }
+    if (!handed_off && lag_limit_us > 0) {
+      auto batch_end = now_us();
+      check_overload(ep_fd, sock_fds, batch_end - batch_start, batch_end);
+    }
+    for (auto conn : dropped) {
+      close_connection(ep_fd, conn);
+    }
+    dropped.clear();
   }
   return 0;
 }
 
-void on_connect(int ep_fd, int sock_fd, const sockaddr_in &addr,
-                socklen_t len) {
-  if (sock_fd > EPOLL_SIZE) {
-    fmt::printf("too many fds\n");
-    exit(-1);
+PollMode poll_mode() {
+  const char *mode = getenv("CONCURRENT_POLL");
+  if (mode == nullptr || strcmp(mode, "block") == 0) {
+    return PollMode::BLOCK;
+  } else if (strcmp(mode, "spin") == 0) {
+    return PollMode::SPIN;
+  } else if (strcmp(mode, "hybrid") == 0) {
+    return PollMode::HYBRID;
   }
-  report_connection(addr);
+  fmt::printf("unknown CONCURRENT_POLL mode: %s\n", mode);
+  exit(-1);
+}
+
+void backoff(int empty_polls) {
+  if (empty_polls < SPIN_POLLS) {
+    return;
+  } else if (empty_polls < PAUSE_POLLS) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+  } else {
+    sched_yield();
+  }
+}
+
+int64_t now_us() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void on_connect(int ep_fd, int sock_fd, const sockaddr *addr, socklen_t len,
+                PollMode mode) {
+  PROBE(accept, sock_fd);
+  report_connection(addr, len);
   set_nonblock(sock_fd);
+  if (mode != PollMode::BLOCK && addr->sa_family != AF_UNIX) {
+    // let the kernel spin on the device queue in recv instead of waiting for
+    // the interrupt; needs CAP_NET_ADMIN above net.core.busy_read
+    static const int busy_poll_us = env_int("CONCURRENT_BUSY_POLL_US", 50);
+    // the options are independent; either failing is reported only once
+    static bool warned_busy_poll = false;
+    static bool warned_prefer = false;
+    int prefer = 1;
+    if (setsockopt(sock_fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_us,
+                   sizeof(int)) < 0 &&
+        !warned_busy_poll) {
+      fmt::printf("SO_BUSY_POLL: %s\n", strerror(errno));
+      warned_busy_poll = true;
+    }
+    if (setsockopt(sock_fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer,
+                   sizeof(int)) < 0 &&
+        !warned_prefer) {
+      fmt::printf("SO_PREFER_BUSY_POLL: %s\n", strerror(errno));
+      warned_prefer = true;
+    }
+  }
+  add_connection(ep_fd, sock_fd, State::INIT_CONN);
+}
+
+// adds the listeners to the epoll set, or takes them out to pause accepts
+void watch_listeners(int ep_fd, const std::vector<int> &sock_fds, bool accept) {
+  for (int sock_fd : sock_fds) {
+    if (!accept) {
+      epoll_ctl(ep_fd, EPOLL_CTL_DEL, sock_fd, nullptr);
+      continue;
+    }
+    epoll_event accept_event;
+    memset(&accept_event, 0, sizeof(epoll_event));
+    accept_event.data.fd = sock_fd;
+    accept_event.events = EPOLLIN;
+    if (epoll_ctl(ep_fd, EPOLL_CTL_ADD, sock_fd, &accept_event) < 0) {
+      fmt::printf("epoll_ctl: %s\n", strerror(errno));
+      exit(-1);
+    }
+  }
+}
+
+Connection *add_connection(int ep_fd, int fd, State state) {
+  static const auto greeting = std::make_shared<const std::string>("*");
   auto conn = new Connection;
-  conn->send_buf[0] = '*';
-  conn->send_pos = 0;
-  conn->send_end = 1;
-  conn->fd = sock_fd;
-  conn->state = State::INIT_CONN;
+  conn->queued = 0;
+  conn->dropped = false;
+  conn->taken_over = false;
+  conn->fd = fd;
+  conn->state = state;
+  conn->bytes_in = 0;
+  conn->bytes_out = 0;
+  conn->msg_bytes = 0;
+  conn->unsent = 0;
+  auto now = now_us();
+  conn->bytes_limit = make_bucket(rate_bytes, now);
+  conn->msgs_limit = make_bucket(rate_msgs, now);
+  conn->resume_at = 0;
+  conn->cost = 0;
+  conn->cost_window = cost_window;
   epoll_event event;
   memset(&event, 0, sizeof(epoll_event));
-  event.data.fd = sock_fd;
+  event.data.fd = fd;
   event.data.ptr = conn;
-  event.events = EPOLLOUT;
+  if (state == State::INIT_CONN) {
+    conn->out.push_back({greeting, 0});
+    conn->queued = conn->unsent = greeting->size();
+    event.events = EPOLLOUT;
+  } else {
+    event.events = EPOLLIN;
+  }
+  conn->events = event.events;
 
-  if (epoll_ctl(ep_fd, EPOLL_CTL_ADD, sock_fd, &event) < 0) {
+  if (epoll_ctl(ep_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
     fmt::printf("epoll add: %s\n", strerror(errno));
     exit(-1);
   }
+  connections.insert(conn);
+  capture_connect(fd);
+  return conn;
 }
 
-void on_receive(int ep_fd, Connection *conn) {
-  int fd = conn->fd;
-  if (conn->state == State::INIT_CONN || conn->send_pos < conn->send_end) {
-    epoll_event event;
-    memset(&event, 0, sizeof(event));
-    event.data.fd = fd;
-    event.data.ptr = conn;
-    event.events |= EPOLLOUT;
-    if (epoll_ctl(ep_fd, EPOLL_CTL_MOD, fd, &event) < 0) {
-      fmt::printf("epoll mod: %s\n", strerror(errno));
-      exit(-1);
+// connection states as tagged on hot restart
+constexpr char TAG_INIT_CONN = 'N';
+constexpr char TAG_WAIT_FOR_MESSAGE = 'W';
+constexpr char TAG_IN_MESSAGE = 'I';
+
+void on_takeover(int ep_fd, const HandoffFd &passed) {
+  set_nonblock(passed.fd);
+  switch (passed.tag) {
+    case TAG_INIT_CONN:
+      add_connection(ep_fd, passed.fd, State::INIT_CONN);
+      break;
+    case TAG_WAIT_FOR_MESSAGE:
+      add_connection(ep_fd, passed.fd, State::WAIT_FOR_MESSAGE)->taken_over =
+          true;
+      break;
+    case TAG_IN_MESSAGE:
+      add_connection(ep_fd, passed.fd, State::IN_MESSAGE)->taken_over = true;
+      break;
+    default:
+      fmt::printf("unknown handoff tag %c\n", passed.tag);
+      close(passed.fd);
+      break;
+  }
+}
+
+void on_handoff(int ep_fd, const std::vector<int> &sock_fds, int handoff_fd) {
+  std::vector<HandoffFd> fds;
+  for (int sock_fd : sock_fds) {
+    fds.push_back({sock_fd, HANDOFF_LISTENER});
+  }
+  std::vector<Connection *> passed;
+  for (auto conn : connections) {
+    // connections with output still queued are drained here instead
+    if (conn->dropped) {
+      continue;
+    } else if (conn->state == State::INIT_CONN && conn->out.size() == 1) {
+      fds.push_back({conn->fd, TAG_INIT_CONN});
+    } else if (!conn->out.empty()) {
+      continue;
+    } else if (conn->state == State::WAIT_FOR_MESSAGE) {
+      fds.push_back({conn->fd, TAG_WAIT_FOR_MESSAGE});
+    } else {
+      fds.push_back({conn->fd, TAG_IN_MESSAGE});
     }
-    return;
+    passed.push_back(conn);
   }
-  char buf[MAX_BUF];
-  int nread = recv(fd, buf, MAX_BUF, 0);
-  if (nread == 0) {  // remote closed
-    fmt::printf("remote peer closed.\n");
-    epoll_ctl(ep_fd, EPOLL_CTL_DEL, fd, nullptr);
-    close(fd);
+  handoff(handoff_fd, fds);
+
+  // the next generation shares these sockets, so they have to leave the epoll
+  // set explicitly: closing our fd alone would not remove them
+  watch_listeners(ep_fd, sock_fds, false);
+  for (int sock_fd : sock_fds) {
+    close(sock_fd);
+  }
+  for (auto conn : passed) {
+    // the next generation captures the rest as a new connection
+    capture_close(conn->fd);
+    epoll_ctl(ep_fd, EPOLL_CTL_DEL, conn->fd, nullptr);
+    close(conn->fd);
+    connections.erase(conn);
+    throttled.erase(conn);
     delete conn;
+  }
+}
+
+void on_receive(int ep_fd, Connection *conn) {
+  int fd = conn->fd;
+  if (!conn->out.empty()) {
+    watch(ep_fd, conn, EPOLLOUT);
     return;
-  } else if (nread < 0) {
-    // if (errno == EAGAIN || errno == EWOULDBLOCK) {}
-    fmt::printf("recv: %s\n", strerror(errno));
   }
+  auto now = now_us();
+  refill(conn->bytes_limit, now);
+  refill(conn->msgs_limit, now);
+  size_t budget = read_budget;
+  if (conn->bytes_limit.rate > 0) {
+    budget = std::min(budget, std::max<size_t>(conn->bytes_limit.tokens, 1));
+  }
+
+  // whatever is left over past the budget waits for the next iteration
+  char buf[MAX_BUF];
+  size_t nbytes = 0;
+  bool closed = false;
   // sometimes we have data received but no message will be send
-  bool ready_to_send = false;
-  for (int i = 0; i < nread; ++i) {
-    switch (conn->state) {
-      case State::INIT_CONN:  // unreachable
-        break;
-      case State::WAIT_FOR_MESSAGE:
-        if (buf[i] == '^') {
-          conn->state = State::IN_MESSAGE;
-        }
-        break;
-      case State::IN_MESSAGE:
-        if (buf[i] == '$') {
-          conn->state = State::WAIT_FOR_MESSAGE;
-        } else {
-          ready_to_send = true;
-          conn->send_buf[conn->send_end++] = buf[i] + 1;
-        }
-        break;
+  std::string transformed;
+  while (nbytes < budget) {
+    size_t want = std::min<size_t>(MAX_BUF, budget - nbytes);
+    int nread = recv(fd, buf, want, 0);
+    if (nread == 0) {  // remote closed
+      fmt::printf("remote peer closed.\n");
+      closed = true;
+      break;
+    } else if (nread < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        fmt::printf("recv: %s\n", strerror(errno));
+      }
+      break;
+    }
+    if (conn->bytes_in == 0 && !conn->taken_over) {
+      PROBE(first_byte, fd, nread);
+    }
+    capture_data(fd, buf, nread);
+    conn->bytes_in += nread;
+    nbytes += nread;
+    for (int i = 0; i < nread; ++i) {
+      switch (conn->state) {
+        case State::INIT_CONN:  // unreachable
+          break;
+        case State::WAIT_FOR_MESSAGE:
+          if (buf[i] == '^') {
+            conn->state = State::IN_MESSAGE;
+            conn->msg_bytes = 0;
+            conn->msgs_limit.tokens -= 1;
+            PROBE(msg_start, fd);
+          }
+          break;
+        case State::IN_MESSAGE:
+          if (buf[i] == '$') {
+            conn->state = State::WAIT_FOR_MESSAGE;
+            PROBE(msg_end, fd, conn->msg_bytes);
+          } else {
+            transformed.push_back(buf[i] + 1);
+            conn->msg_bytes++;
+          }
+          break;
+      }
+    }
+    if (static_cast<size_t>(nread) < want) {  // drained the socket
+      break;
     }
   }
-  epoll_event event;
-  memset(&event, 0, sizeof(event));
-  event.data.fd = fd;
-  event.data.ptr = conn;
-  if (ready_to_send) {
-    event.events |= EPOLLOUT;
-  } else {
-    event.events |= EPOLLIN;
+  conn->bytes_limit.tokens -= nbytes;
+  charge(conn, nbytes);
+  if (!transformed.empty()) {
+    auto data = std::make_shared<const std::string>(std::move(transformed));
+    if (pubsub) {
+      // the publisher pays for the whole fan-out
+      charge(conn, data->size() * connections.size());
+      for (auto subscriber : connections) {
+        enqueue(ep_fd, subscriber, data);
+      }
+    } else {
+      charge(conn, data->size());
+      enqueue(ep_fd, conn, data);
+    }
   }
-  if (epoll_ctl(ep_fd, EPOLL_CTL_MOD, fd, &event) < 0) {
-    fmt::printf("epoll mod: %s\n", strerror(errno));
-    exit(-1);
+  if (closed || conn->dropped) {
+    // enqueue may already have dropped it, so closing goes through the same
+    // deferred path
+    drop_connection(conn);
+    return;
+  }
+
+  int64_t wait_us = std::max(
+      refill_wait_us(conn->bytes_limit,
+                     std::min<double>(conn->bytes_limit.burst, MAX_BUF)),
+      refill_wait_us(conn->msgs_limit, 1));
+  if (wait_us > 0) {
+    conn->resume_at = now + wait_us;
+    throttled.insert(conn);
+  }
+  if (conn->out.empty()) {
+    watch(ep_fd, conn, read_events(conn));
   }
 }
 
 void on_send(int ep_fd, Connection *conn) {
   int fd = conn->fd;
-  if (conn->send_pos >= conn->send_end) {
-    epoll_event event;
-    memset(&event, 0, sizeof(event));
-    event.data.fd = fd;
-    event.data.ptr = conn;
-    event.events |= EPOLLIN;
-    if (epoll_ctl(ep_fd, EPOLL_CTL_MOD, fd, &event) < 0) {
-      fmt::printf("epoll mod: %s\n", strerror(errno));
-      exit(-1);
-    }
+  if (conn->out.empty()) {
+    watch(ep_fd, conn, read_events(conn));
     return;
   }
 
-  int avaliable = conn->send_end - conn->send_pos;
-  int nsend = send(fd, &conn->send_buf[conn->send_pos], avaliable, 0);
+  iovec iov[IOV_BATCH];
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  for (auto &chunk : conn->out) {
+    if (msg.msg_iovlen == IOV_BATCH) {
+      break;
+    }
+    iov[msg.msg_iovlen].iov_base = const_cast<char *>(&(*chunk.data)[chunk.pos]);
+    iov[msg.msg_iovlen].iov_len = chunk.data->size() - chunk.pos;
+    msg.msg_iovlen++;
+  }
+  // a subscriber that went away must not take the server down with SIGPIPE
+  ssize_t nsend = sendmsg(fd, &msg, MSG_NOSIGNAL);
   if (nsend == -1) {
-    // if(errno == EAGAIN || errno == EWOULDBLOCK){}
-    fmt::printf("send: %s\n", strerror(errno));
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      fmt::printf("send: %s\n", strerror(errno));
+      drop_connection(conn);
+    }
+    return;
   }
-  bool continue_to_write = false;
-  if (nsend < avaliable) {
-    continue_to_write = true;
-    conn->send_pos += nsend;
-  } else {
-    conn->send_pos = 0;
-    conn->send_end = 0;
+  conn->bytes_out += nsend;
+  conn->queued -= nsend;
+  while (nsend > 0) {
+    auto &chunk = conn->out.front();
+    size_t left = chunk.data->size() - chunk.pos;
+    if (static_cast<size_t>(nsend) < left) {
+      chunk.pos += nsend;
+      break;
+    }
+    nsend -= left;
+    conn->out.pop_front();
+  }
+  if (conn->out.empty()) {
+    PROBE(send_done, fd, conn->unsent);
+    conn->unsent = 0;
     if (conn->state == State::INIT_CONN) {
       conn->state = State::WAIT_FOR_MESSAGE;
     }
+    watch(ep_fd, conn, read_events(conn));
+  }
+}
+
+void watch(int ep_fd, Connection *conn, uint32_t events) {
+  if (conn->events == events) {
+    return;
   }
   epoll_event event;
   memset(&event, 0, sizeof(epoll_event));
-  event.data.fd = fd;
+  event.data.fd = conn->fd;
   event.data.ptr = conn;
-  if (continue_to_write) {
-    event.events |= EPOLLOUT;
-  } else {
-    event.events |= EPOLLIN;
-  }
-  if (epoll_ctl(ep_fd, EPOLL_CTL_MOD, fd, &event) < 0) {
-    fmt::printf("epoll ctl: %s\n", strerror(errno));
+  event.events = events;
+  if (epoll_ctl(ep_fd, EPOLL_CTL_MOD, conn->fd, &event) < 0) {
+    fmt::printf("epoll mod: %s\n", strerror(errno));
     exit(-1);
   }
-}
\ No newline at end of file
+  conn->events = events;
+}
+
+void enqueue(int ep_fd, Connection *conn, const Payload &data) {
+  if (conn->dropped) {
+    return;
+  }
+  if (conn->queued + data->size() > max_queued) {
+    fmt::printf("dropping slow connection %d with %zu bytes queued\n",
+                conn->fd, conn->queued);
+    drop_connection(conn);
+    return;
+  }
+  conn->out.push_back({data, 0});
+  conn->queued += data->size();
+  conn->unsent += data->size();
+  watch(ep_fd, conn, EPOLLOUT);
+}
+
+// closing is deferred because the current batch of events, or the publish
+// loop over `connections`, may still refer to the connection
+void drop_connection(Connection *conn) {
+  if (!conn->dropped) {
+    conn->dropped = true;
+    dropped.push_back(conn);
+  }
+}
+
+void close_connection(int ep_fd, Connection *conn) {
+  PROBE(close, conn->fd, conn->bytes_in, conn->bytes_out);
+  capture_close(conn->fd);
+  epoll_ctl(ep_fd, EPOLL_CTL_DEL, conn->fd, nullptr);
+  close(conn->fd);
+  connections.erase(conn);
+  throttled.erase(conn);
+  delete conn;
+}
+
+TokenBucket make_bucket(double rate, int64_t now) {
+  double burst = std::max(rate * burst_ms / 1000, 1.0);
+  return TokenBucket{rate, burst, burst, now};
+}
+
+void refill(TokenBucket &bucket, int64_t now) {
+  if (bucket.rate > 0) {
+    double elapsed = (now - bucket.last_us) / 1e6;
+    bucket.tokens =
+        std::min(bucket.burst, bucket.tokens + bucket.rate * elapsed);
+  }
+  bucket.last_us = now;
+}
+
+// how long until the bucket holds `want` tokens again, 0 if it already does
+int64_t refill_wait_us(const TokenBucket &bucket, double want) {
+  if (bucket.rate <= 0 || bucket.tokens >= want) {
+    return 0;
+  }
+  return static_cast<int64_t>((want - bucket.tokens) / bucket.rate * 1e6) + 1;
+}
+
+// throttled connections watch for nothing until they resume
+uint32_t read_events(const Connection *conn) {
+  if (conn->resume_at != 0) {
+    return 0;
+  }
+  return EPOLLIN;
+}
+
+// lets throttled connections that are due read again, and returns how long
+// until the next one is, or -1 if none are throttled
+int64_t resume_throttled(int ep_fd, int64_t now) {
+  int64_t next = -1;
+  for (auto it = throttled.begin(); it != throttled.end();) {
+    auto conn = *it;
+    if (conn->resume_at <= now) {
+      conn->resume_at = 0;
+      it = throttled.erase(it);
+      if (!conn->dropped && conn->out.empty()) {
+        watch(ep_fd, conn, EPOLLIN);
+      }
+      continue;
+    }
+    if (next < 0 || conn->resume_at - now < next) {
+      next = conn->resume_at - now;
+    }
+    ++it;
+  }
+  return next;
+}
+
+void charge(Connection *conn, int64_t nbytes) {
+  if (conn->cost_window != cost_window) {
+    conn->cost_window = cost_window;
+    conn->cost = 0;
+  }
+  conn->cost += nbytes;
+}
+
+void check_overload(int ep_fd, const std::vector<int> &sock_fds, int64_t lag,
+                    int64_t now) {
+  window_lag = std::max(window_lag, lag);
+  if (now < window_end) {
+    return;
+  }
+  if (window_lag > lag_limit_us) {
+    if (!overloaded) {
+      fmt::printf("overloaded: loop lag %ldus, pausing accepts\n", window_lag);
+      watch_listeners(ep_fd, sock_fds, false);
+      overloaded = true;
+    }
+    shed_connections();
+  } else if (overloaded && window_lag < lag_limit_us / 2) {
+    fmt::printf("recovered: loop lag %ldus, accepting again\n", window_lag);
+    watch_listeners(ep_fd, sock_fds, true);
+    overloaded = false;
+  }
+  window_end = now + window_us;
+  window_lag = 0;
+  cost_window++;
+}
+
+// drops the connections that cost the most during the window just closed
+void shed_connections() {
+  std::vector<Connection *> costly;
+  for (auto conn : connections) {
+    if (!conn->dropped && conn->cost_window == cost_window && conn->cost > 0) {
+      costly.push_back(conn);
+    }
+  }
+  size_t nshed = std::min<size_t>(SHED_PER_WINDOW, costly.size());
+  std::partial_sort(costly.begin(), costly.begin() + nshed, costly.end(),
+                    [](const Connection *a, const Connection *b) {
+                      return a->cost > b->cost;
+                    });
+  for (size_t i = 0; i < nshed; ++i) {
+    fmt::printf("shedding connection %d: %ld bytes in the last window\n",
+                costly[i]->fd, costly[i]->cost);
+    drop_connection(costly[i]);
+  }
+}
@@ -0,0 +1,316 @@
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "capture.h"
+#include "event2/buffer.h"
+#include "event2/bufferevent.h"
+#include "event2/event.h"
+#include "event2/listener.h"
+#include "event2/thread.h"
+#include "fmt/ostream.h"
+#include "fmt/printf.h"
+#include "helpers.h"
+#include "probes.h"
+
+// input chunks transformed per evbuffer_peek
+constexpr int PEEK_VECS = 16;
+
+enum class State {
+  WAIT_FOR_MESSAGE,
+  IN_MESSAGE,
+};
+
+// one event_base and the connections it owns; with a single thread the
+// main base that also runs the listener is the only worker
+struct Worker {
+  event_base *base;
+  std::atomic<int> connections{0};
+};
+
+struct Server {
+  event_base *base;
+  std::vector<evconnlistener *> listeners;
+  event *handoff_event;
+  std::vector<Worker *> workers;
+  size_t next_worker;
+  std::atomic<bool> draining{false};
+};
+
+struct Connection {
+  State state;
+  Worker *worker;
+  Server *server;
+  evutil_socket_t fd;
+  int64_t bytes_in;
+  int64_t bytes_out;
+  int64_t msg_bytes;
+  int64_t unsent;  // queued on the output chain since the last send_done
+  bool paused;     // reading stopped until the output chain drains
+};
+
+// CONCURRENT_MAX_QUEUED_KB: a connection stops being read while it has more
+// output than this queued, and the input buffered for it is capped the same
+size_t max_queued = 0;
+
+struct Assignment {
+  evutil_socket_t fd;
+  Worker *worker;
+  Server *server;
+};
+
+void on_accept(evconnlistener *listener, evutil_socket_t fd, sockaddr *addr,
+               int len, void *arg);
+void on_assign(evutil_socket_t, short, void *arg);
+void start_connection(Server *server, Worker *worker, evutil_socket_t fd);
+void on_read(bufferevent *bev, void *arg);
+void on_write(bufferevent *bev, void *arg);
+void on_event(bufferevent *bev, short events, void *arg);
+void on_handoff(evutil_socket_t handoff_fd, short, void *arg);
+void exit_if_drained(Server *server, Worker *worker);
+
+int main() {
+  int nthreads = std::max(1, env_int("CONCURRENT_THREADS", 1));
+  if (nthreads > 1 && evthread_use_pthreads() != 0) {
+    fmt::printf("evthread_use_pthreads failed\n");
+    exit(-1);
+  }
+
+  auto sock_fds = listenServers("0.0.0.0", 9990);
+  max_queued = std::max(env_int("CONCURRENT_MAX_QUEUED_KB", 1024), 1) * 1024;
+
+  Server server;
+  server.base = event_base_new();
+  server.next_worker = 0;
+  if (server.base == nullptr) {
+    fmt::printf("event_base_new failed\n");
+    exit(-1);
+  }
+  std::vector<std::thread> threads;
+  if (nthreads == 1) {
+    pin_thread(0);
+    server.workers.push_back(new Worker{server.base});
+  } else {
+    for (int i = 0; i < nthreads; ++i) {
+      auto worker = new Worker{event_base_new()};
+      if (worker->base == nullptr) {
+        fmt::printf("event_base_new failed\n");
+        exit(-1);
+      }
+      server.workers.push_back(worker);
+      threads.emplace_back([worker, i]() {
+        pin_thread(i);
+        event_base_loop(worker->base, EVLOOP_NO_EXIT_ON_EMPTY);
+      });
+    }
+  }
+
+  for (int sock_fd : sock_fds) {
+    set_nonblock(sock_fd);
+    auto listener = evconnlistener_new(server.base, on_accept, &server,
+                                       LEV_OPT_CLOSE_ON_FREE, -1, sock_fd);
+    if (listener == nullptr) {
+      fmt::printf("evconnlistener_new: %s\n", strerror(errno));
+      exit(-1);
+    }
+    server.listeners.push_back(listener);
+  }
+
+  server.handoff_event = nullptr;
+  auto handoff_fd = handoffServer();
+  if (handoff_fd >= 0) {
+    server.handoff_event =
+        event_new(server.base, handoff_fd, EV_READ, on_handoff, &server);
+    event_add(server.handoff_event, nullptr);
+  }
+
+  // returns once the listener is handed off and the main base has drained
+  event_base_dispatch(server.base);
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  return 0;
+}
+
+void on_accept(evconnlistener *listener, evutil_socket_t fd, sockaddr *addr,
+               int len, void *arg) {
+  auto server = reinterpret_cast<Server *>(arg);
+  report_connection(addr, len);
+  auto worker = server->workers[server->next_worker++ % server->workers.size()];
+  worker->connections++;
+  if (worker->base == server->base) {
+    start_connection(server, worker, fd);
+    return;
+  }
+  // bufferevents must be created on the thread running their base
+  auto assignment = new Assignment{fd, worker, server};
+  if (event_base_once(worker->base, -1, EV_TIMEOUT, on_assign, assignment,
+                      nullptr) != 0) {
+    fmt::printf("event_base_once failed\n");
+    worker->connections--;
+    close(fd);
+    delete assignment;
+  }
+}
+
+void on_assign(evutil_socket_t, short, void *arg) {
+  auto assignment = reinterpret_cast<Assignment *>(arg);
+  start_connection(assignment->server, assignment->worker, assignment->fd);
+  delete assignment;
+}
+
+void start_connection(Server *server, Worker *worker, evutil_socket_t fd) {
+  auto bev = bufferevent_socket_new(worker->base, fd, BEV_OPT_CLOSE_ON_FREE);
+  if (bev == nullptr) {
+    fmt::printf("bufferevent_socket_new failed\n");
+    close(fd);
+    worker->connections--;
+    exit_if_drained(server, worker);
+    return;
+  }
+  auto conn =
+      new Connection{State::WAIT_FOR_MESSAGE, worker, server, fd, 0, 0, 0, 1,
+                     false};
+  PROBE(accept, fd);
+  capture_connect(fd);
+  bufferevent_setcb(bev, on_read, on_write, on_event, conn);
+  // libevent stops reading the socket once this much input is buffered
+  bufferevent_setwatermark(bev, EV_READ, 0, max_queued);
+  // the greeting is chained by reference instead of being copied in
+  evbuffer_add_reference(bufferevent_get_output(bev), "*", 1, nullptr,
+                         nullptr);
+  bufferevent_enable(bev, EV_READ | EV_WRITE);
+}
+
+void on_read(bufferevent *bev, void *arg) {
+  auto conn = reinterpret_cast<Connection *>(arg);
+  evbuffer *input = bufferevent_get_input(bev);
+  evbuffer *output = bufferevent_get_output(bev);
+
+  if (conn->bytes_in == 0) {
+    PROBE(first_byte, conn->fd, evbuffer_get_length(input));
+  }
+  // transformed bytes are written straight into space reserved at the tail
+  // of the output chain, with no intermediate send buffer
+  while (evbuffer_get_length(input) > 0) {
+    if (evbuffer_get_length(output) > max_queued) {
+      // a client that sends without reading gets no further; on_write picks
+      // up the rest of the input once the output chain has drained
+      bufferevent_disable(bev, EV_READ);
+      conn->paused = true;
+      return;
+    }
+    evbuffer_iovec in[PEEK_VECS];
+    int nvecs = std::min(evbuffer_peek(input, -1, nullptr, in, PEEK_VECS),
+                         PEEK_VECS);
+    size_t nbytes = 0;
+    for (int v = 0; v < nvecs; ++v) {
+      nbytes += in[v].iov_len;
+      capture_data(conn->fd, in[v].iov_base, in[v].iov_len);
+    }
+    evbuffer_iovec out;
+    if (evbuffer_reserve_space(output, nbytes, &out, 1) != 1) {
+      fmt::printf("evbuffer_reserve_space failed\n");
+      on_event(bev, BEV_EVENT_ERROR, conn);
+      return;
+    }
+    char *dst = static_cast<char *>(out.iov_base);
+    size_t nsend = 0;
+    for (int v = 0; v < nvecs; ++v) {
+      auto src = static_cast<const char *>(in[v].iov_base);
+      for (size_t i = 0; i < in[v].iov_len; ++i) {
+        switch (conn->state) {
+          case State::WAIT_FOR_MESSAGE:
+            if (src[i] == '^') {
+              conn->state = State::IN_MESSAGE;
+              conn->msg_bytes = 0;
+              PROBE(msg_start, conn->fd);
+            }
+            break;
+          case State::IN_MESSAGE:
+            if (src[i] == '$') {
+              conn->state = State::WAIT_FOR_MESSAGE;
+              PROBE(msg_end, conn->fd, conn->msg_bytes);
+            } else {
+              dst[nsend++] = src[i] + 1;
+              conn->msg_bytes++;
+            }
+            break;
+        }
+      }
+    }
+    out.iov_len = nsend;
+    evbuffer_commit_space(output, &out, 1);
+    evbuffer_drain(input, nbytes);
+    conn->bytes_in += nbytes;
+    conn->unsent += nsend;
+  }
+}
+
+// called once the output chain has been written out completely
+void on_write(bufferevent *bev, void *arg) {
+  auto conn = reinterpret_cast<Connection *>(arg);
+  PROBE(send_done, conn->fd, conn->unsent);
+  conn->bytes_out += conn->unsent;
+  conn->unsent = 0;
+  if (conn->paused) {
+    conn->paused = false;
+    bufferevent_enable(bev, EV_READ);
+    on_read(bev, conn);
+  }
+}
+
+void on_event(bufferevent *bev, short events, void *arg) {
+  auto conn = reinterpret_cast<Connection *>(arg);
+  if (events & BEV_EVENT_ERROR) {
+    fmt::printf("bufferevent: %s\n", strerror(EVUTIL_SOCKET_ERROR()));
+  } else if (events & BEV_EVENT_EOF) {
+    fmt::printf("remote peer closed.\n");
+  } else {
+    return;
+  }
+  auto server = conn->server;
+  auto worker = conn->worker;
+  PROBE(close, conn->fd, conn->bytes_in, conn->bytes_out);
+  capture_close(conn->fd);
+  bufferevent_free(bev);
+  delete conn;
+  worker->connections--;
+  exit_if_drained(server, worker);
+}
+
+void on_handoff(evutil_socket_t handoff_fd, short, void *arg) {
+  auto server = reinterpret_cast<Server *>(arg);
+  std::vector<HandoffFd> fds;
+  for (auto listener : server->listeners) {
+    fds.push_back({evconnlistener_get_fd(listener), HANDOFF_LISTENER});
+  }
+  handoff(handoff_fd, fds);
+  for (auto listener : server->listeners) {
+    evconnlistener_free(listener);
+  }
+  server->listeners.clear();
+  event_free(server->handoff_event);
+
+  // workers exit once their last connection is gone
+  server->draining = true;
+  for (auto worker : server->workers) {
+    exit_if_drained(server, worker);
+  }
+}
+
+void exit_if_drained(Server *server, Worker *worker) {
+  if (server->draining && worker->connections == 0) {
+    event_base_loopexit(worker->base, nullptr);
+  }
+}
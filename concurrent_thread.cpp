@@ -8,14 +8,18 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
-#include <thread>
+#include <algorithm>
 
+#include "ThreadCache.h"
+#include "absl/cleanup/cleanup.h"
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
 #include "absl/strings/string_view.h"
+#include "capture.h"
 #include "fmt/ostream.h"
 #include "fmt/printf.h"
 #include "helpers.h"
+#include "probes.h"
 
 constexpr int MAX_BUF = 1024;
 
@@ -27,20 +31,27 @@ enum class State {
 absl::Status serve(int);
 
 int main() {
-  auto sock_fd = tcpServer("0.0.0.0", 9990);
+  auto sock_fds = listenServers("0.0.0.0", 9990);
+  auto handoff_fd = handoffServer();
+  size_t stack_kb = std::max(env_int("CONCURRENT_THREAD_STACK_KB", 64), 0);
+  ThreadCache threads(env_int("CONCURRENT_MAX_THREADS", 512),
+                      env_int("CONCURRENT_THREAD_CACHE", 16), stack_kb * 1024,
+                      pin_thread);
 
   while (1) {
-    sockaddr_in peer_addr;
-    socklen_t peer_addr_len = sizeof(peer_addr);
-
-    int client_fd = accept(sock_fd, reinterpret_cast<sockaddr *>(&peer_addr),
-                           &peer_addr_len);
-    if (client_fd < 0) {
+    sockaddr_storage peer_addr;
+    socklen_t peer_addr_len;
+    int client_fd =
+        accept_or_handoff(sock_fds, handoff_fd, &peer_addr, &peer_addr_len);
+    if (client_fd == HANDED_OFF) {
+      break;
+    } else if (client_fd < 0) {
       perror("accept");
       exit(-1);
     }
-    report_connection(peer_addr);
-    new std::thread([client_fd]() {
+    PROBE(accept, client_fd);
+    report_connection(reinterpret_cast<sockaddr *>(&peer_addr), peer_addr_len);
+    auto status = threads.Run([client_fd]() {
       auto status = serve(client_fd);
       if (!status.ok()) {
         fmt::print(stderr, "{}\n", status.ToString());
@@ -48,14 +59,30 @@ int main() {
       fmt::printf("peer done\n");
       close(client_fd);
     });
+    if (!status.ok()) {
+      fmt::print(stderr, "{}\n", status.ToString());
+      close(client_fd);
+    }
   }
+  // the cache's destructor lets running connections finish and reaps the
+  // parked threads
   return 0;
 }
 
 absl::Status serve(int client_fd) {
+  int64_t bytes_in = 0;
+  int64_t bytes_out = 0;
+  int64_t msg_bytes = 0;
+  capture_connect(client_fd);
+  absl::Cleanup record_close = [&] {
+    PROBE(close, client_fd, bytes_in, bytes_out);
+    capture_close(client_fd);
+  };
   if (send(client_fd, "*", 1, 0) < 1) {
     return absl::UnknownError(strerror(errno));
   }
+  PROBE(send_done, client_fd, 1);
+  bytes_out += 1;
 
   auto state = State::WAIT_FOR_MESSAGE;
   while (1) {
@@ -66,21 +93,32 @@ absl::Status serve(int client_fd) {
     } else if (len == 0) {
       break;
     }
+    if (bytes_in == 0) {
+      PROBE(first_byte, client_fd, len);
+    }
+    capture_data(client_fd, buf, len);
+    bytes_in += len;
     for (int i = 0; i < len; ++i) {
       switch (state) {
         case State::WAIT_FOR_MESSAGE:
           if (buf[i] == '^') {
             state = State::IN_MESSAGE;
+            msg_bytes = 0;
+            PROBE(msg_start, client_fd);
           }
           break;
         case State::IN_MESSAGE: {
-          if (buf[i] == '$')
+          if (buf[i] == '$') {
             state = State::WAIT_FOR_MESSAGE;
-          else {
+            PROBE(msg_end, client_fd, msg_bytes);
+          } else {
             buf[i] += 1;
             if (send(client_fd, &buf[i], 1, 0) < 1) {
               return absl::UnknownError(strerror(errno));
             }
+            PROBE(send_done, client_fd, 1);
+            bytes_out += 1;
+            msg_bytes += 1;
           }
           break;
         }
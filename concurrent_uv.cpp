@@ -1,9 +1,14 @@
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "capture.h"
 #include "fmt/printf.h"
 #include "helpers.h"
+#include "probes.h"
 #include "uv.h"
 
-constexpr int MAX_BUF = 1024;
-
 enum class State
 {
     INIT_CONN,
@@ -14,13 +19,35 @@ enum class State
 struct Connection
 {
     State state;
-    char send_buf[MAX_BUF];
-    int send_end;
-    uv_tcp_t *client;
+    uv_stream_t *client; // a uv_tcp_t or, on a unix socket, a uv_pipe_t
+    int fd;
+    int64_t bytes_in;
+    int64_t bytes_out;
+    int64_t msg_bytes;
+};
+
+// transformed output is immutable once built, so in pub/sub mode one buffer
+// is written by reference to every subscriber instead of being copied
+using Payload = std::shared_ptr<const std::string>;
+
+// keeps the payload alive until its write to one connection completes
+struct WriteRequest
+{
+    uv_write_t req;
+    Payload data;
+    Connection *conn;
 };
 
 constexpr int BACKLOG = 5;
 uv_loop_t *loop;
+// uv_tcp_t and uv_pipe_t listeners
+std::vector<uv_stream_t *> servers;
+// every live connection, the subscribers in pub/sub mode
+std::unordered_set<Connection *> connections;
+// CONCURRENT_PUBSUB: messages go to every connection instead of the sender
+bool pubsub = false;
+// connections with more output queued than this are too slow and dropped
+size_t max_queued = 0;
 
 #define CHECK_STATUS(status, msg) fmt::printf("[ERROR][%s:%d]%s: %s\n", __FILE__, __LINE__, msg, uv_strerror(status))
 
@@ -30,43 +57,57 @@ void on_alloc_buffer(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf);
 void on_peer_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf);
 void on_wrote_buf(uv_write_t *req, int status);
 void on_client_close(uv_handle_t *handle);
+void on_handoff(uv_poll_t *handle, int status, int events);
+uv_stream_t *new_stream(uv_handle_type type);
+void send_to(Connection *conn, const Payload &data);
+void close_client(Connection *conn);
 
 int main()
 {
+    pin_thread(0);
+    pubsub = env_int("CONCURRENT_PUBSUB", 0) != 0;
+    max_queued = env_int("CONCURRENT_MAX_QUEUED_KB", 1024) * 1024;
     loop = uv_default_loop();
 
     int rc;
-    uv_tcp_t server;
-
-    rc = uv_tcp_init(loop, &server);
-    if (rc < 0)
-    {
-        CHECK_STATUS(rc, "uv_tcp_init");
-        exit(rc);
-    }
-
-    sockaddr_in server_addr;
-    rc = uv_ip4_addr("127.0.0.1", 9990, &server_addr);
-    if (rc < 0)
+    // bound (or taken over from the previous generation) by the helpers
+    for (int sock_fd : listenServers("127.0.0.1", 9990))
     {
-        CHECK_STATUS(rc, "uv_ip4_addr");
-        exit(rc);
-    }
+        uv_stream_t *server;
+        if (socket_family(sock_fd) == AF_UNIX)
+        {
+            server = new_stream(UV_NAMED_PIPE);
+            rc = uv_pipe_open(reinterpret_cast<uv_pipe_t *>(server), sock_fd);
+        }
+        else
+        {
+            server = new_stream(UV_TCP);
+            rc = uv_tcp_open(reinterpret_cast<uv_tcp_t *>(server), sock_fd);
+        }
+        if (rc < 0)
+        {
+            CHECK_STATUS(rc, "uv_open");
+            exit(rc);
+        }
 
-    rc = uv_tcp_bind(&server, reinterpret_cast<sockaddr *>(&server_addr), 0);
-    if (rc < 0)
-    {
-        CHECK_STATUS(rc, "uv_tcp_bind");
-        exit(rc);
+        rc = uv_listen(server, BACKLOG, on_connected);
+        if (rc < 0)
+        {
+            CHECK_STATUS(rc, "uv_listen");
+            exit(rc);
+        }
+        servers.push_back(server);
     }
 
-    rc = uv_listen(reinterpret_cast<uv_stream_t *>(&server), BACKLOG, on_connected);
-    if (rc < 0)
+    uv_poll_t handoff_poll;
+    int handoff_fd = handoffServer();
+    if (handoff_fd >= 0)
     {
-        CHECK_STATUS(rc, "uv_listen");
-        exit(rc);
+        uv_poll_init(loop, &handoff_poll, handoff_fd);
+        uv_poll_start(&handoff_poll, UV_READABLE, on_handoff);
     }
 
+    // after a handoff the loop runs until the remaining clients are gone
     uv_run(loop, UV_RUN_DEFAULT);
 
     return uv_loop_close(loop);
@@ -81,45 +122,47 @@ void on_connected(uv_stream_t *server, int status)
         return;
     }
 
-    uv_tcp_t *client = new uv_tcp_t();
-    int rc;
-    rc = uv_tcp_init(loop, client);
-    if (rc < 0)
+    uv_stream_t *client = new_stream(server->type);
+    if (client == nullptr)
     {
-        CHECK_STATUS(rc, "uv_tcp_init");
         return;
     }
 
-    if (uv_accept(server, reinterpret_cast<uv_stream_t *>(client)) == 0) // 连接已accept，出错需要uv_close
+    int rc;
+    if (uv_accept(server, client) == 0) // 连接已accept，出错需要uv_close
     {
-        sockaddr_in peer_addr;
-        int peer_addr_len = sizeof(sockaddr_in);
-        rc = uv_tcp_getpeername(client, reinterpret_cast<sockaddr *>(&peer_addr), &peer_addr_len);
-        if (rc < 0)
+        uv_os_fd_t fd;
+        uv_fileno(reinterpret_cast<uv_handle_t *>(client), &fd);
+        sockaddr_storage peer_addr;
+        socklen_t peer_addr_len = sizeof(peer_addr);
+        if (getpeername(fd, reinterpret_cast<sockaddr *>(&peer_addr), &peer_addr_len) < 0)
         {
-            CHECK_STATUS(rc, "uv_tcp_getpeername");
+            CHECK_STATUS(uv_translate_sys_error(errno), "getpeername");
             uv_close(reinterpret_cast<uv_handle_t *>(client), on_client_close);
             return;
         }
-        report_connection(peer_addr);
+        report_connection(reinterpret_cast<sockaddr *>(&peer_addr), peer_addr_len);
 
+        static char greeting[] = "*";
         auto conn = new Connection();
         conn->state = State::INIT_CONN;
-        conn->send_buf[0] = '*';
-        conn->send_end = 1;
         conn->client = client;
+        conn->fd = fd;
         client->data = conn;
+        connections.insert(conn);
+        PROBE(accept, conn->fd);
+        capture_connect(conn->fd);
 
-        uv_buf_t write_buf = uv_buf_init(conn->send_buf, conn->send_end);
+        uv_buf_t write_buf = uv_buf_init(greeting, 1);
 
         uv_write_t *req = new uv_write_t();
         req->data = conn;
-        rc = uv_write(req, reinterpret_cast<uv_stream_t *>(client), &write_buf, conn->send_end, on_wrote_init);
+        rc = uv_write(req, client, &write_buf, 1, on_wrote_init);
         if (rc < 0)
         {
             CHECK_STATUS(rc, "uv_write");
             delete req;
-            uv_close(reinterpret_cast<uv_handle_t *>(client), on_client_close);
+            close_client(conn);
         }
     }
     else
@@ -135,17 +178,18 @@ void on_wrote_init(uv_write_t *req, int status)
     {
         CHECK_STATUS(status, "on_wrote_init");
         delete req;
-        uv_close(reinterpret_cast<uv_handle_t *>(conn->client), on_client_close);
+        close_client(conn);
         return;
     }
+    PROBE(send_done, conn->fd, 1);
+    conn->bytes_out += 1;
     conn->state = State::WAIT_FOR_MESSAGE;
-    conn->send_end = 0;
 
-    int rc = uv_read_start(reinterpret_cast<uv_stream_t *>(conn->client), on_alloc_buffer, on_peer_read);
+    int rc = uv_read_start(conn->client, on_alloc_buffer, on_peer_read);
     if (rc < 0)
     {
         CHECK_STATUS(rc, "uv_read_start");
-        uv_close(reinterpret_cast<uv_handle_t *>(conn->client), on_client_close);
+        close_client(conn);
     }
     delete req;
 }
@@ -165,7 +209,7 @@ void on_peer_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
         {
             CHECK_STATUS(nread, "on_peer_read");
         }
-        uv_close(reinterpret_cast<uv_handle_t *>(conn->client), on_client_close);
+        close_client(conn);
     }
     else if (nread == 0)
     {
@@ -173,11 +217,18 @@ void on_peer_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
     }
     else
     {
+        capture_data(conn->fd, buf->base, nread);
         if (conn->state == State::INIT_CONN)
         {
             delete[] buf->base;
             return;
         }
+        if (conn->bytes_in == 0)
+        {
+            PROBE(first_byte, conn->fd, nread);
+        }
+        conn->bytes_in += nread;
+        std::string transformed;
         for (int i = 0; i < nread; ++i)
         {
             switch (conn->state)
@@ -186,54 +237,107 @@ void on_peer_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
                 break;
             case State::WAIT_FOR_MESSAGE:
                 if (buf->base[i] == '^')
+                {
                     conn->state = State::IN_MESSAGE;
+                    conn->msg_bytes = 0;
+                    PROBE(msg_start, conn->fd);
+                }
                 break;
             case State::IN_MESSAGE:
                 if (buf->base[i] == '$')
+                {
                     conn->state = State::WAIT_FOR_MESSAGE;
+                    PROBE(msg_end, conn->fd, conn->msg_bytes);
+                }
                 else
                 {
-                    conn->send_buf[conn->send_end++] = buf->base[i] + 1;
+                    transformed.push_back(buf->base[i] + 1);
+                    conn->msg_bytes++;
                 }
                 break;
             }
         }
-        if (conn->send_end > 0)
+        if (!transformed.empty())
         {
-            uv_buf_t write_buf = uv_buf_init(conn->send_buf, conn->send_end);
-            uv_write_t *wreq = new uv_write_t();
-            wreq->data = conn;
-            int rc = uv_write(wreq, reinterpret_cast<uv_stream_t *>(conn->client), &write_buf, 1, on_wrote_buf);
-            if (rc < 0)
+            auto data = std::make_shared<const std::string>(std::move(transformed));
+            if (pubsub)
+            {
+                for (auto subscriber : connections)
+                {
+                    send_to(subscriber, data);
+                }
+            }
+            else
             {
-                CHECK_STATUS(rc, "uv_write");
-                delete wreq;
-                uv_close(reinterpret_cast<uv_handle_t *>(conn->client), on_client_close);
+                send_to(conn, data);
             }
         }
     }
     delete[] buf->base;
 }
 
+void send_to(Connection *conn, const Payload &data)
+{
+    auto stream = conn->client;
+    if (uv_is_closing(reinterpret_cast<uv_handle_t *>(stream)))
+    {
+        return;
+    }
+    if (uv_stream_get_write_queue_size(stream) + data->size() > max_queued)
+    {
+        fmt::printf("dropping slow connection %d with %zu bytes queued\n",
+                    conn->fd, uv_stream_get_write_queue_size(stream));
+        close_client(conn);
+        return;
+    }
+    uv_buf_t write_buf = uv_buf_init(const_cast<char *>(data->data()), data->size());
+    auto wreq = new WriteRequest{uv_write_t(), data, conn};
+    wreq->req.data = wreq;
+    int rc = uv_write(&wreq->req, stream, &write_buf, 1, on_wrote_buf);
+    if (rc < 0)
+    {
+        CHECK_STATUS(rc, "uv_write");
+        delete wreq;
+        close_client(conn);
+    }
+}
+
 void on_wrote_buf(uv_write_t *req, int status)
 {
-    auto conn = reinterpret_cast<Connection *>(req->data);
+    auto wreq = reinterpret_cast<WriteRequest *>(req->data);
+    auto conn = wreq->conn;
     if (status < 0)
     {
-        CHECK_STATUS(status, "on_wrote_buf");
-        delete req;
-        uv_close(reinterpret_cast<uv_handle_t *>(conn->client), on_client_close);
+        if (status != UV_ECANCELED)
+        {
+            CHECK_STATUS(status, "on_wrote_buf");
+        }
+        delete wreq;
+        close_client(conn);
         return;
     }
-    if (conn->send_buf[0] == 'S')
+    if ((*wreq->data)[0] == 'S')
     {
+        connections.erase(conn);
         delete conn;
-        delete req;
+        delete wreq;
         uv_stop(loop);
         return;
     }
-    conn->send_end = 0;
-    delete req;
+    PROBE(send_done, conn->fd, wreq->data->size());
+    conn->bytes_out += wreq->data->size();
+    delete wreq;
+}
+
+void close_client(Connection *conn)
+{
+    auto handle = reinterpret_cast<uv_handle_t *>(conn->client);
+    if (!uv_is_closing(handle))
+    {
+        // uv_close closes the fd right away, before on_client_close runs
+        capture_close(conn->fd);
+        uv_close(handle, on_client_close);
+    }
 }
 
 void on_client_close(uv_handle_t *handle)
@@ -241,7 +345,52 @@ void on_client_close(uv_handle_t *handle)
     auto conn = reinterpret_cast<Connection *>(handle->data);
     if (conn != nullptr)
     {
+        PROBE(close, conn->fd, conn->bytes_in, conn->bytes_out);
+        connections.erase(conn);
         delete conn;
     }
-    delete handle;
-}
\ No newline at end of file
+    delete reinterpret_cast<uv_any_handle *>(handle);
+}
+
+void on_handoff(uv_poll_t *handle, int status, int events)
+{
+    uv_os_fd_t handoff_fd;
+    uv_fileno(reinterpret_cast<uv_handle_t *>(handle), &handoff_fd);
+    uv_close(reinterpret_cast<uv_handle_t *>(handle), nullptr);
+
+    std::vector<HandoffFd> fds;
+    for (auto server : servers)
+    {
+        uv_os_fd_t sock_fd;
+        uv_fileno(reinterpret_cast<uv_handle_t *>(server), &sock_fd);
+        fds.push_back({sock_fd, HANDOFF_LISTENER});
+    }
+    handoff(handoff_fd, fds);
+    for (auto server : servers)
+    {
+        uv_close(reinterpret_cast<uv_handle_t *>(server), on_client_close);
+    }
+    servers.clear();
+}
+
+// a tcp or pipe handle, sized for either so that on_client_close can free it
+uv_stream_t *new_stream(uv_handle_type type)
+{
+    auto handle = new uv_any_handle();
+    int rc;
+    if (type == UV_NAMED_PIPE)
+    {
+        rc = uv_pipe_init(loop, &handle->pipe, 0);
+    }
+    else
+    {
+        rc = uv_tcp_init(loop, &handle->tcp);
+    }
+    if (rc < 0)
+    {
+        CHECK_STATUS(rc, "uv_init");
+        delete handle;
+        return nullptr;
+    }
+    return &handle->stream;
+}
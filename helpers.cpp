@@ -4,18 +4,36 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
 #include "absl/strings/string_view.h"
 #include "fmt/ostream.h"
 #include "fmt/printf.h"
+#include "probes.h"
+
+DEFINE_PROBE(accept);
+DEFINE_PROBE(first_byte);
+DEFINE_PROBE(msg_start);
+DEFINE_PROBE(msg_end);
+DEFINE_PROBE(send_done);
+DEFINE_PROBE(close);
 
 static absl::StatusOr<int> tcp_server(fmt::string_view addr, uint16_t port) {
   int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -41,19 +59,323 @@ static absl::StatusOr<int> tcp_server(fmt::string_view addr, uint16_t port) {
   return listen_fd;
 }
 
-int tcpServer(const char *addr, uint16_t port) {
-  auto r = tcp_server(addr, port);
-  if (!r.ok()) {
-    fmt::print(stderr, "{}\n", r.status());
+// `name` is a filesystem path, or "@name" for the abstract namespace
+static absl::StatusOr<int> unix_server(const std::string &name) {
+  sockaddr_un listen_addr;
+  memset(&listen_addr, 0, sizeof(listen_addr));
+  listen_addr.sun_family = AF_UNIX;
+  if (name.empty() || name.size() >= sizeof(listen_addr.sun_path)) {
+    return absl::InvalidArgumentError(
+        fmt::format("bad unix socket name: {}", name));
+  }
+  memcpy(listen_addr.sun_path, name.data(), name.size());
+  socklen_t len = offsetof(sockaddr_un, sun_path) + name.size();
+  if (name[0] == '@') {
+    listen_addr.sun_path[0] = '\0';
+  } else {
+    len += 1;
+    // a socket left behind by a server that is gone would fail the bind, but
+    // one that still accepts connections belongs to a live server
+    struct stat st;
+    if (stat(name.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+      int probe_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (probe_fd < 0) {
+        return absl::UnknownError(fmt::format("socket: {}", strerror(errno)));
+      }
+      int rc =
+          connect(probe_fd, reinterpret_cast<sockaddr *>(&listen_addr), len);
+      int err = errno;
+      close(probe_fd);
+      if (rc == 0) {
+        return absl::UnknownError(
+            fmt::format("bind {}: {}", name, strerror(EADDRINUSE)));
+      } else if (err == ECONNREFUSED) {
+        unlink(name.c_str());
+      }
+    }
+  }
+
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0) {
+    return absl::UnknownError(fmt::format("socket: {}", strerror(errno)));
+  }
+  if (bind(listen_fd, reinterpret_cast<sockaddr *>(&listen_addr), len) != 0) {
+    close(listen_fd);
+    return absl::UnknownError(
+        fmt::format("bind {}: {}", name, strerror(errno)));
+  }
+  if (listen(listen_fd, 5) != 0) {
+    close(listen_fd);
+    return absl::UnknownError(fmt::format("listen: {}", strerror(errno)));
+  }
+  return listen_fd;
+}
+
+// one entry of CONCURRENT_LISTEN
+static absl::StatusOr<int> listen_server(const std::string &spec) {
+  if (spec.compare(0, 5, "unix:") == 0) {
+    return unix_server(spec.substr(5));
+  } else if (spec.compare(0, 4, "tcp:") == 0) {
+    auto colon = spec.rfind(':');
+    char *end;
+    long port = strtol(spec.c_str() + colon + 1, &end, 10);
+    if (colon <= 4 || *end != '\0' || port <= 0 || port > UINT16_MAX) {
+      return absl::InvalidArgumentError(
+          fmt::format("bad tcp listener: {}", spec));
+    }
+    return tcp_server(spec.substr(4, colon - 4), port);
+  }
+  return absl::InvalidArgumentError(fmt::format("bad listener: {}", spec));
+}
+
+static std::string format_addr(const sockaddr *addr, socklen_t len) {
+  if (addr->sa_family == AF_INET) {
+    auto in = reinterpret_cast<const sockaddr_in *>(addr);
+    char addr_p[INET_ADDRSTRLEN] = {0};
+    inet_ntop(AF_INET, &in->sin_addr, addr_p, INET_ADDRSTRLEN);
+    return fmt::format("{}:{}", addr_p, ntohs(in->sin_port));
+  } else if (addr->sa_family == AF_UNIX) {
+    auto un = reinterpret_cast<const sockaddr_un *>(addr);
+    size_t n = len - std::min<size_t>(len, offsetof(sockaddr_un, sun_path));
+    if (n == 0) {  // clients rarely bind their end
+      return "unix:(unnamed)";
+    } else if (un->sun_path[0] == '\0') {
+      return "unix:@" + std::string(un->sun_path + 1, n - 1);
+    }
+    return "unix:" + std::string(un->sun_path, strnlen(un->sun_path, n));
+  }
+  return fmt::format("(family {})", addr->sa_family);
+}
+
+// fds per handoff message, well under the kernel's SCM_MAX_FD
+constexpr int HANDOFF_BATCH = 64;
+
+static absl::StatusOr<sockaddr_un> handoff_addr() {
+  const char *path = getenv("CONCURRENT_HANDOFF");
+  if (path == nullptr || *path == '\0') {
+    return absl::NotFoundError("CONCURRENT_HANDOFF is not set");
+  }
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    return absl::InvalidArgumentError(
+        fmt::format("handoff path too long: {}", path));
+  }
+  strcpy(addr.sun_path, path);
+  return addr;
+}
+
+// Receives every fd the previous generation passes; an empty result means
+// there is no previous generation to take over from.
+static absl::StatusOr<std::vector<HandoffFd>> take_over() {
+  std::vector<HandoffFd> fds;
+  auto addr = handoff_addr();
+  if (!addr.ok()) {
+    return fds;
+  }
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (fd < 0) {
+    return absl::UnknownError(fmt::format("socket: {}", strerror(errno)));
+  }
+  if (connect(fd, reinterpret_cast<sockaddr *>(&*addr), sizeof(*addr)) != 0) {
+    close(fd);
+    if (errno == ENOENT || errno == ECONNREFUSED) {
+      return fds;
+    }
+    return absl::UnknownError(fmt::format("connect: {}", strerror(errno)));
+  }
+  while (1) {
+    char tags[HANDOFF_BATCH];
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)];
+    iovec iov = {tags, sizeof(tags)};
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n < 0) {
+      close(fd);
+      return absl::UnknownError(fmt::format("recvmsg: {}", strerror(errno)));
+    } else if (n == 0) {  // previous generation is done passing fds
+      break;
+    }
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == nullptr || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int) * n)) {
+      close(fd);
+      return absl::DataLossError("malformed handoff message");
+    }
+    for (ssize_t i = 0; i < n; ++i) {
+      int passed;
+      memcpy(&passed, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+      fds.push_back({passed, tags[i]});
+    }
+  }
+  close(fd);
+  return fds;
+}
+
+std::vector<int> listenServers(const char *addr, uint16_t port,
+                               std::vector<HandoffFd> *conns) {
+  auto inherited = take_over();
+  if (!inherited.ok()) {
+    fmt::print(stderr, "{}\n", inherited.status());
     exit(-1);
   }
-  return r.value();
+  std::vector<int> listen_fds;
+  for (auto &passed : *inherited) {
+    if (passed.tag == HANDOFF_LISTENER) {
+      // the previous generation may have made it non-blocking
+      int flags = fcntl(passed.fd, F_GETFL, 0);
+      fcntl(passed.fd, F_SETFL, flags & ~O_NONBLOCK);
+      listen_fds.push_back(passed.fd);
+    } else if (conns != nullptr) {
+      conns->push_back(passed);
+    } else {
+      close(passed.fd);
+    }
+  }
+  if (!listen_fds.empty()) {
+    fmt::printf("took over %d listeners and %d connections\n",
+                static_cast<int>(listen_fds.size()),
+                conns != nullptr ? static_cast<int>(conns->size()) : 0);
+    return listen_fds;
+  }
+
+  std::string specs = fmt::format("tcp:{}:{}", addr, port);
+  const char *listen = getenv("CONCURRENT_LISTEN");
+  if (listen != nullptr && *listen != '\0') {
+    specs = listen;
+  }
+  size_t pos = 0;
+  while (pos <= specs.size()) {
+    size_t comma = std::min(specs.find(',', pos), specs.size());
+    auto r = listen_server(specs.substr(pos, comma - pos));
+    if (!r.ok()) {
+      fmt::print(stderr, "{}\n", r.status());
+      exit(-1);
+    }
+    sockaddr_storage bound;
+    socklen_t bound_len = sizeof(bound);
+    getsockname(*r, reinterpret_cast<sockaddr *>(&bound), &bound_len);
+    fmt::printf("listening on %s\n",
+                format_addr(reinterpret_cast<sockaddr *>(&bound), bound_len));
+    listen_fds.push_back(*r);
+    pos = comma + 1;
+  }
+  return listen_fds;
+}
+
+int handoffServer() {
+  auto addr = handoff_addr();
+  if (!addr.ok()) {
+    return -1;
+  }
+  // the previous generation's socket, if any, was already taken over
+  unlink(addr->sun_path);
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0 ||
+      bind(fd, reinterpret_cast<sockaddr *>(&*addr), sizeof(*addr)) != 0 ||
+      listen(fd, 1) != 0) {
+    fmt::printf("handoff socket %s: %s\n", addr->sun_path, strerror(errno));
+    exit(-1);
+  }
+  return fd;
+}
+
+void handoff(int handoff_fd, const std::vector<HandoffFd> &fds) {
+  int fd = accept(handoff_fd, nullptr, nullptr);
+  close(handoff_fd);
+  if (fd < 0) {
+    fmt::printf("handoff accept: %s\n", strerror(errno));
+    return;
+  }
+  for (size_t pos = 0; pos < fds.size(); pos += HANDOFF_BATCH) {
+    size_t n = std::min<size_t>(HANDOFF_BATCH, fds.size() - pos);
+    char tags[HANDOFF_BATCH];
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)];
+    memset(control, 0, sizeof(control));
+    iovec iov = {tags, n};
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+    for (size_t i = 0; i < n; ++i) {
+      tags[i] = fds[pos + i].tag;
+      memcpy(CMSG_DATA(cmsg) + i * sizeof(int), &fds[pos + i].fd, sizeof(int));
+    }
+    if (sendmsg(fd, &msg, 0) < 0) {
+      fmt::printf("handoff sendmsg: %s\n", strerror(errno));
+      break;
+    }
+  }
+  close(fd);
+  fmt::printf("handed off %d fds\n", static_cast<int>(fds.size()));
+}
+
+int accept_or_handoff(const std::vector<int> &sock_fds, int handoff_fd,
+                      sockaddr_storage *peer, socklen_t *peer_len) {
+  *peer_len = sizeof(*peer);
+  if (sock_fds.size() == 1 && handoff_fd < 0) {
+    return accept(sock_fds[0], reinterpret_cast<sockaddr *>(peer), peer_len);
+  }
+  std::vector<pollfd> fds;
+  for (int fd : sock_fds) {
+    fds.push_back({fd, POLLIN, 0});
+  }
+  if (handoff_fd >= 0) {
+    fds.push_back({handoff_fd, POLLIN, 0});
+  }
+  // rotates through the listeners so a busy one cannot starve the rest
+  static size_t turn = 0;
+  while (1) {
+    if (poll(fds.data(), fds.size(), -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (handoff_fd >= 0 && (fds.back().revents & POLLIN)) {
+      std::vector<HandoffFd> listeners;
+      for (int fd : sock_fds) {
+        listeners.push_back({fd, HANDOFF_LISTENER});
+      }
+      handoff(handoff_fd, listeners);
+      for (int fd : sock_fds) {
+        close(fd);
+      }
+      return HANDED_OFF;
+    }
+    for (size_t i = 0; i < sock_fds.size(); ++i) {
+      auto &ready = fds[(turn + i) % sock_fds.size()];
+      if (ready.revents & POLLIN) {
+        turn = (turn + i + 1) % sock_fds.size();
+        return accept(ready.fd, reinterpret_cast<sockaddr *>(peer), peer_len);
+      }
+    }
+  }
+}
+
+void report_connection(const sockaddr *peer, socklen_t peer_len) {
+  fmt::printf("connection from %s\n", format_addr(peer, peer_len));
 }
 
-void report_connection(const sockaddr_in &peer) {
-  char peer_addr_p[INET_ADDRSTRLEN] = {0};
-  inet_ntop(AF_INET, &peer.sin_addr, peer_addr_p, INET_ADDRSTRLEN);
-  fmt::printf("connection from %s:%d\n", peer_addr_p, ntohs(peer.sin_port));
+int socket_family(int fd) {
+  sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  if (getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &len) != 0) {
+    return -1;
+  }
+  return addr.ss_family;
 }
 
 void set_nonblock(int fd) {
@@ -65,4 +387,178 @@ void set_nonblock(int fd) {
   if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
     exit(-1);
   }
+}
+
+int env_int(const char *name, int default_value) {
+  const char *value = getenv(name);
+  if (value == nullptr || *value == '\0') {
+    return default_value;
+  }
+  char *end;
+  long v = strtol(value, &end, 10);
+  if (*end != '\0') {
+    fmt::print(stderr, "{}: not an integer: {}\n", name, value);
+    exit(-1);
+  }
+  return static_cast<int>(v);
+}
+
+// parses the kernel's cpulist format, e.g. "0-3,8,10-11"
+static absl::StatusOr<std::vector<int>> parse_cpulist(const std::string &s) {
+  std::vector<int> cpus;
+  const char *p = s.c_str();
+  while (*p != '\0' && *p != '\n') {
+    char *end;
+    long first = strtol(p, &end, 10);
+    if (end == p || first < 0) {
+      return absl::InvalidArgumentError(fmt::format("bad cpulist: {}", s));
+    }
+    long last = first;
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p || last < first) {
+        return absl::InvalidArgumentError(fmt::format("bad cpulist: {}", s));
+      }
+    }
+    for (long cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(static_cast<int>(cpu));
+    }
+    p = *end == ',' ? end + 1 : end;
+  }
+  return cpus;
+}
+
+static std::string read_sysfs(const std::string &path) {
+  std::ifstream in(path);
+  std::string line;
+  std::getline(in, line);
+  return line;
+}
+
+// CPUs this process may run on, grouped by NUMA node in node order
+static std::vector<std::vector<int>> cpus_by_node() {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+
+  std::vector<std::vector<int>> nodes;
+  for (int node = 0;; ++node) {
+    auto cpulist = read_sysfs(
+        fmt::format("/sys/devices/system/node/node{}/cpulist", node));
+    if (cpulist.empty()) {
+      break;
+    }
+    auto cpus = parse_cpulist(cpulist);
+    if (!cpus.ok()) {
+      break;
+    }
+    std::vector<int> usable;
+    for (int cpu : *cpus) {
+      if (CPU_ISSET(cpu, &allowed)) {
+        usable.push_back(cpu);
+      }
+    }
+    if (!usable.empty()) {
+      nodes.push_back(std::move(usable));
+    }
+  }
+  if (nodes.empty()) {  // no NUMA sysfs, treat the machine as one node
+    nodes.emplace_back();
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &allowed)) {
+        nodes.back().push_back(cpu);
+      }
+    }
+  }
+  return nodes;
+}
+
+static std::vector<int> compact_order(
+    const std::vector<std::vector<int>> &nodes) {
+  std::vector<int> order;
+  for (auto &node : nodes) {
+    order.insert(order.end(), node.begin(), node.end());
+  }
+  return order;
+}
+
+static std::vector<int> scatter_order(
+    const std::vector<std::vector<int>> &nodes) {
+  std::vector<int> order;
+  for (size_t i = 0;; ++i) {
+    bool any = false;
+    for (auto &node : nodes) {
+      if (i < node.size()) {
+        order.push_back(node[i]);
+        any = true;
+      }
+    }
+    if (!any) {
+      break;
+    }
+  }
+  return order;
+}
+
+static absl::StatusOr<std::vector<int>> irq_local_order(
+    const std::string &ifname) {
+  std::string dev = fmt::format("/sys/class/net/{}/device/", ifname);
+  auto cpulist = read_sysfs(dev + "local_cpulist");
+  if (cpulist.empty()) {
+    return absl::NotFoundError(
+        fmt::format("{} has no local_cpulist, is it a physical NIC?", ifname));
+  }
+  auto local = parse_cpulist(cpulist);
+  if (!local.ok()) {
+    return local.status();
+  }
+  std::vector<int> order;
+  for (int cpu : compact_order(cpus_by_node())) {
+    if (std::find(local->begin(), local->end(), cpu) != local->end()) {
+      order.push_back(cpu);
+    }
+  }
+  if (order.empty()) {
+    return absl::FailedPreconditionError(
+        fmt::format("no allowed cpu is local to {}", ifname));
+  }
+  return order;
+}
+
+static absl::StatusOr<std::vector<int>> pin_order(const char *policy) {
+  std::string p(policy);
+  if (p == "compact") {
+    return compact_order(cpus_by_node());
+  } else if (p == "scatter") {
+    return scatter_order(cpus_by_node());
+  } else if (p.compare(0, 5, "list:") == 0) {
+    return parse_cpulist(p.substr(5));
+  } else if (p.compare(0, 4, "irq:") == 0) {
+    return irq_local_order(p.substr(4));
+  }
+  return absl::InvalidArgumentError(
+      fmt::format("unknown CONCURRENT_PIN policy: {}", p));
+}
+
+void pin_thread(int slot) {
+  const char *policy = getenv("CONCURRENT_PIN");
+  if (policy == nullptr || *policy == '\0') {
+    return;
+  }
+  static const auto order = pin_order(policy);
+  if (!order.ok() || order->empty()) {
+    fmt::print(stderr, "pin_thread: {}\n",
+               order.ok() ? "empty cpu list" : order.status().ToString());
+    exit(-1);
+  }
+  // memory first touched by a pinned thread (its stack, the connections and
+  // buffers it allocates) is placed on that thread's NUMA node by the kernel
+  int cpu = (*order)[slot % order->size()];
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+    fmt::print(stderr, "sched_setaffinity cpu {}: {}\n", cpu, strerror(errno));
+  }
 }
\ No newline at end of file
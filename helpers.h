@@ -1,11 +1,58 @@
 #pragma once
 
 #include <stdint.h>
+#include <sys/socket.h>
 
-struct sockaddr_in;
+#include <vector>
 
-int tcpServer(const char *, uint16_t);
+// An fd passed from one server generation to the next on hot restart. `tag`
+// is HANDOFF_LISTENER or a server-defined connection state.
+struct HandoffFd {
+  int fd;
+  char tag;
+};
 
-void report_connection(const sockaddr_in &peer);
+constexpr char HANDOFF_LISTENER = 'L';
+// returned by accept_or_handoff once the next generation took the listener
+constexpr int HANDED_OFF = -2;
+
+// Binds the listeners named by CONCURRENT_LISTEN, a comma separated list of
+//   tcp:<ip>:<port>   e.g. tcp:0.0.0.0:9990
+//   unix:<path>       filesystem socket, replacing a stale one at <path>
+//   unix:@<name>      socket in the abstract namespace
+// or a single TCP listener on addr:port when it is unset. When
+// CONCURRENT_HANDOFF names the handoff socket of a running previous
+// generation, takes over its listeners (and the live connections it passes,
+// into `conns`) instead of binding new ones.
+std::vector<int> listenServers(const char *addr, uint16_t port,
+                               std::vector<HandoffFd> *conns = nullptr);
+
+// Binds the CONCURRENT_HANDOFF socket for the next generation; -1 when unset.
+int handoffServer();
+
+// Passes `fds` to the next generation waiting on handoff_fd and closes it.
+void handoff(int handoff_fd, const std::vector<HandoffFd> &fds);
+
+// Blocking accept on whichever of sock_fds is ready first. Also serves a
+// takeover request on handoff_fd, after which it closes sock_fds and returns
+// HANDED_OFF.
+int accept_or_handoff(const std::vector<int> &sock_fds, int handoff_fd,
+                      sockaddr_storage *peer, socklen_t *peer_len);
+
+void report_connection(const sockaddr *peer, socklen_t peer_len);
+
+// AF_INET, AF_UNIX, ... of a socket, or -1.
+int socket_family(int fd);
 
 void set_nonblock(int);
+
+// Reads an integer tunable from the environment.
+int env_int(const char *name, int default_value);
+
+// Pins the calling thread according to the CONCURRENT_PIN policy:
+//   compact        fill the CPUs of one NUMA node before moving to the next
+//   scatter        round-robin threads across NUMA nodes
+//   list:<cpus>    explicit cpulist, e.g. list:0-3,8
+//   irq:<ifname>   CPUs local to the NIC that takes the interrupts
+// `slot` is the thread's index within its server; unset means no pinning.
+void pin_thread(int slot);
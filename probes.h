@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+// USDT probes on the connection and message lifecycle, provider "concurrent":
+//   accept(fd, ts)                     connection accepted
+//   first_byte(fd, nbytes, ts)         first data read from a connection
+//   msg_start(fd, ts)                  '^' seen
+//   msg_end(fd, msg_bytes, ts)         '$' seen, msg_bytes transformed
+//   send_done(fd, nbytes, ts)          queued output fully written
+//   close(fd, bytes_in, bytes_out, ts) connection closed
+// ts is CLOCK_MONOTONIC in ns. Each probe is a nop and its arguments are not
+// evaluated unless a tracer is attached, e.g.
+//   bpftrace -e 'usdt:./event_driven:concurrent:msg_end { ... }'
+#if __has_include(<sys/sdt.h>) && !defined(CONCURRENT_NO_PROBES)
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+// tracers bump a probe's semaphore while they are attached to it; volatile,
+// as in systemtap's generated headers, so that a loop without calls cannot
+// keep a stale copy and miss an attach
+#define PROBE_SEMAPHORE(name) concurrent_##name##_semaphore
+#define DECLARE_PROBE(name) \
+  extern volatile unsigned short PROBE_SEMAPHORE(name)
+#define DEFINE_PROBE(name)                                    \
+  __attribute__((section(".probes"))) volatile unsigned short \
+      PROBE_SEMAPHORE(name) = 0
+
+#define PROBE(name, ...)                                      \
+  do {                                                        \
+    if (__builtin_expect(PROBE_SEMAPHORE(name), 0)) {         \
+      STAP_PROBEV(concurrent, name, __VA_ARGS__, probe_ts()); \
+    }                                                         \
+  } while (0)
+
+inline int64_t probe_ts() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#else
+
+#define DECLARE_PROBE(name) struct concurrent_##name##_probe
+#define DEFINE_PROBE(name) struct concurrent_##name##_probe
+#define PROBE(name, ...) \
+  do {                   \
+  } while (0)
+
+#endif
+
+DECLARE_PROBE(accept);
+DECLARE_PROBE(first_byte);
+DECLARE_PROBE(msg_start);
+DECLARE_PROBE(msg_end);
+DECLARE_PROBE(send_done);
+DECLARE_PROBE(close);
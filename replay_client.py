@@ -0,0 +1,227 @@
+import socket
+import argparse
+import errno
+import os
+import selectors
+import struct
+import time
+
+# see capture.h for the layout
+HEADER = struct.Struct('<4sIQQI4x')
+RECORD = struct.Struct('<QIIB7x')
+CAPTURE_CONNECT, CAPTURE_DATA, CAPTURE_CLOSE = 1, 2, 3
+
+# bytes queued towards the server before -f stops reading ahead
+MAX_PENDING = 1 << 20
+
+
+def read_capture(path):
+    with open(path, 'rb') as f:
+        data = f.read(HEADER.size)
+        magic, version, used, _, _ = HEADER.unpack(data)
+        if magic != b'CCAP' or version != 1:
+            raise SystemExit(f'{path} is not a capture file')
+        data += f.read(used - HEADER.size)
+
+    records = []
+    pos = HEADER.size
+    while pos + RECORD.size <= used:
+        ts_ns, conn_id, length, kind = RECORD.unpack_from(data, pos)
+        if kind == 0:  # reserved but never written
+            break
+        start = pos + RECORD.size
+        records.append((ts_ns, conn_id, kind, data[start:start + length]))
+        pos += (RECORD.size + length + 7) & ~7
+    return records
+
+
+def connect(target, port):
+    # target is an ip, or unix:<path> / unix:@<name> for a unix socket. The
+    # connect completes in the background: a server with a full backlog must
+    # not stall the connections it is already serving.
+    if target.startswith('unix:'):
+        path = target[len('unix:'):]
+        if path.startswith('@'):
+            path = '\0' + path[1:]
+        sock_fd = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        address = path
+    else:
+        sock_fd = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        sock_fd.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        address = (target, port)
+    sock_fd.setblocking(False)
+    err = sock_fd.connect_ex(address)
+    if err not in (0, errno.EINPROGRESS):
+        sock_fd.close()
+        raise OSError(err, os.strerror(err))
+    return sock_fd
+
+
+class Connection:
+    def __init__(self, sock_fd):
+        self.sock_fd = sock_fd
+        self.out = bytearray()
+        self.closing = False  # the capture closed it once `out` is sent
+        self.shut = False
+
+
+class Replayer:
+    def __init__(self, target, port):
+        self.target = target
+        self.port = port
+        self.sel = selectors.DefaultSelector()
+        self.conns = {}
+        self.pending = 0
+        self.sent = 0
+        self.received = 0
+        self.opened = 0
+        self.failed = 0
+
+    def apply(self, key, kind, data):
+        conn = self.conns.get(key)
+        if kind == CAPTURE_CONNECT:
+            if conn is not None:
+                self.close(key)
+            try:
+                conn = Connection(connect(self.target, self.port))
+            except OSError:
+                self.failed += 1
+                return
+            self.conns[key] = conn
+            self.sel.register(conn.sock_fd, selectors.EVENT_READ, key)
+            self.opened += 1
+        elif conn is None:
+            return  # connected before the capture began
+        elif kind == CAPTURE_DATA:
+            conn.out += data
+            self.pending += len(data)
+            self.watch(key, conn)
+        elif kind == CAPTURE_CLOSE:
+            conn.closing = True
+            self.watch(key, conn)
+
+    def watch(self, key, conn):
+        # writable also means a pending connect has completed
+        events = selectors.EVENT_READ
+        if conn.out or (conn.closing and not conn.shut):
+            events |= selectors.EVENT_WRITE
+        self.sel.modify(conn.sock_fd, events, key)
+
+    def close(self, key, failed=False):
+        if failed:
+            self.failed += 1
+        conn = self.conns.pop(key)
+        self.pending -= len(conn.out)
+        self.sel.unregister(conn.sock_fd)
+        conn.sock_fd.close()
+
+    def poll(self, timeout):
+        if not self.conns:
+            if timeout > 0:
+                time.sleep(timeout)
+            return
+        for sel_key, events in self.sel.select(timeout):
+            key = sel_key.data
+            conn = self.conns.get(key)
+            if conn is None:
+                continue
+            if events & selectors.EVENT_READ:
+                try:
+                    buf = conn.sock_fd.recv(65536)
+                except (BlockingIOError, InterruptedError):
+                    buf = None
+                except OSError:  # refused or reset
+                    self.close(key, failed=True)
+                    continue
+                if buf == b'':  # closed by the server
+                    self.close(key)
+                    continue
+                if buf:
+                    self.received += len(buf)
+            if events & selectors.EVENT_WRITE:
+                try:
+                    if conn.out:
+                        nsend = conn.sock_fd.send(conn.out)
+                        del conn.out[:nsend]
+                        self.pending -= nsend
+                        self.sent += nsend
+                    if not conn.out and conn.closing:
+                        # like the captured client, stop sending but keep
+                        # reading replies until the server closes its end
+                        conn.sock_fd.shutdown(socket.SHUT_WR)
+                        conn.shut = True
+                except (BlockingIOError, InterruptedError):
+                    pass
+                except OSError:
+                    self.close(key, failed=True)
+                    continue
+                self.watch(key, conn)
+
+    def flush(self, linger):
+        # deliver what is queued, then collect replies for `linger` seconds
+        while self.pending > 0:
+            self.poll(0.1)
+        deadline = time.perf_counter() + linger
+        while self.conns and time.perf_counter() < deadline:
+            self.poll(deadline - time.perf_counter())
+        for key in list(self.conns):
+            self.close(key)
+
+
+def replay(records, args):
+    replayer = Replayer(args.ip, args.port)
+    first_ts = records[0][0]
+    start = time.perf_counter()
+    for i, (ts_ns, conn_id, kind, data) in enumerate(records):
+        if args.fast:
+            while replayer.pending > MAX_PENDING:
+                replayer.poll(0.1)
+            if i % 64 == 0:
+                replayer.poll(0)
+        else:
+            due = start + (ts_ns - first_ts) / 1e9 / args.speed
+            while True:
+                wait = due - time.perf_counter()
+                if wait <= 0:
+                    break
+                replayer.poll(wait)
+        # each copy of a captured connection is a connection of its own
+        for copy in range(args.copies):
+            replayer.apply((copy, conn_id), kind, data)
+    replayer.flush(args.linger)
+    return replayer, time.perf_counter() - start
+
+
+def main():
+    argparser = argparse.ArgumentParser('replay a capture against a server')
+    argparser.add_argument('capture', help='file recorded with CONCURRENT_CAPTURE')
+    argparser.add_argument('ip', help='remote ip, or unix:<path> / unix:@<name>')
+    argparser.add_argument('port', type=int, nargs='?', default=9990,
+                           help='remote port')
+    argparser.add_argument('-f', '--fast', action='store_true',
+                           help='replay as fast as possible instead of at the recorded pace')
+    argparser.add_argument('-s', '--speed', type=float, default=1.0,
+                           help='multiplier on the recorded pace')
+    argparser.add_argument('-k', '--copies', type=int, default=1,
+                           help='replay every captured connection k times over')
+    argparser.add_argument('--linger', type=float, default=0.5,
+                           help='seconds to keep reading replies at the end')
+
+    args = argparser.parse_args()
+
+    records = read_capture(args.capture)
+    if not records:
+        print('capture is empty')
+        return
+    recorded = (records[-1][0] - records[0][0]) / 1e9
+    print(f'{len(records)} records over {recorded:.3f}s')
+
+    replayer, elapsed = replay(records, args)
+    print(f'connections: {replayer.opened} ({replayer.failed} failed)  '
+          f'sent: {replayer.sent} bytes  received: {replayer.received} bytes')
+    print(f'replayed in {elapsed:.3f}s '
+          f'({replayer.sent / elapsed / 1e6:.2f} MB/s sent)')
+
+
+if __name__ == '__main__':
+    main()